@@ -1,5 +1,10 @@
+#define _DEFAULT_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
 
 #include <editline/readline.h>
 
@@ -7,73 +12,637 @@
 
 struct lval;
 struct lenv;
+struct lclosure;
+struct lmemo;
+struct lthunk;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct lclosure lclosure;
+typedef struct lmemo lmemo;
+typedef struct lthunk lthunk;
 
 
 enum { LVAL_NUM, LVAL_ERR, LVAL_SYM, 
-	   LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR};
+	   LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_BIG, LVAL_DBL, LVAL_THUNK};
 enum { LERR_DIV_ZERO, LERR_BAD_OP, LERR_BAD_NUM };
 
+//operators of the arithmetic and comparison builtins
+enum { LOP_ADD, LOP_SUB, LOP_MUL, LOP_DIV,
+	   LOP_GT, LOP_LT, LOP_GE, LOP_LE, LOP_EQ, LOP_NE, LOP_AND, LOP_OR };
+
+#define LASSERT(args, cond, err) \
+	if (!(cond)) { lval_del(args); return lval_err(err); }
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
 struct lval {
 	int type;
-	long num;
+	//literals read from source are shared instead of copied, refs
+	//counts what holds one and is 0 for any other value
+	int refs;
 
-	//error and symbol types have string data
-	char* err;
-	char* sym;
+	//only one of these is used, which one depends on the type
+	union {
+		//numbers. Integers that don't fit a long are big, with their
+		//sign in num and their magnitude in 32 bit limbs, least
+		//significant first
+		struct {
+			long num;
+			int limbs_count;
+			unsigned int* limbs;
+		};
+		//floating point numbers
+		double dbl;
 
-	lbuiltin fun;
-	//count and pointer to a list of lval*
-	int count;
-	struct lval** cell;
+		//error and symbol types have string data
+		char* err;
+		struct {
+			char* sym;
+			//inline cache of a symbol, the slot it was found in and the
+			//environment version that is valid for, -1 before the first
+			//lookup
+			long version;
+			int slot;
+			//frame slot of the lambda argument or captured variable a
+			//symbol in a lambda body refers to, -1 for globals
+			int local;
+		};
+
+		//builtins have fun, lambdas have a closure record instead and
+		//memoized functions a memo record
+		struct {
+			lbuiltin fun;
+			lclosure* closure;
+			lmemo* memo;
+		};
+		//an argument not evaluated yet has a thunk record instead
+		lthunk* thunk;
+		//count and pointer to a list of lval*
+		struct {
+			int count;
+			struct lval** cell;
+		};
+	};
 };
 
 struct lenv {
+	//bumped by every lenv_put, invalidating all inline caches
+	long version;
 	int count;
 	char** syms;
 	lval** vals;
+
+	//the lambda running now and its frame, its arguments followed by
+	//what it captured. NULL at the top level
+	lval* fn;
+	lval** frame;
+	int frame_count;
+
+	//a call of a lambda the body of fn ends in, as the function and
+	//its arguments. It is left for lval_call_args to make once fn's
+	//frame is gone, so tail calls don't grow the C stack
+	lval* tail;
+};
+
+//a lambda after closure conversion. Everything it uses from enclosing
+//lambdas is copied into vals when it is created, and symbols in the
+//body index the frame directly. The record never changes, so copies
+//of the lambda share it
+struct lclosure {
+	int refs;
+	lval* formals;
+	lval* names;
+	lval* vals;
+	lval* body;
+	//compiled on the first call in vm mode
+	struct lchunk* chunk;
+	//set for each formal written ~name, whose argument is only
+	//evaluated once the body uses it. NULL when there are none
+	char* lazy;
+	//names bound by lets in the body, each has its own frame slot
+	//after the arguments and before the captured values. let_next
+	//counts the slots given while the body is converted, -1 after
+	lval* lets;
+	int let_next;
+
+	//when calls in the body were inlined, the body as written and the
+	//names of the inlined lambdas with what they were bound to then
+	lval* outline;
+	lval* inlined;
+	lval* callees;
+};
+
+//a result kept by a memoized function, with the arguments it is for
+typedef struct {
+	unsigned long hash;
+	lval* args;
+	lval* val;
+	//the next entry in the same bucket, and the entries used less and
+	//more recently than this one, -1 at the ends
+	int next;
+	int older;
+	int newer;
+} lmemo_entry;
+
+//the function a memo wrapper calls and the results it has kept, at
+//most size of them. Once it is full the least recently used entry is
+//reused. Copies of the wrapper share the record and its statistics
+struct lmemo {
+	int refs;
+	lval* fn;
+	int size;
+	int count;
+	int buckets_count;
+	int* buckets;
+	lmemo_entry* entries;
+	int newest;
+	int oldest;
+	long hits;
+	long misses;
+
+	//set for macros, whose argument lists are the code they were
+	//called with and whose results are expansions. The cpu time
+	//spent in calls that missed is only measured for them
+	int macro;
+	clock_t time;
 };
 
+#define MEMO_SIZE 1024
+
+//the argument for a lazy formal: its code, or the chunk the vm
+//compiled it to, with the lambda and frame of the call it was written
+//in. The call it is passed to returns before they are gone, and
+//anything a value could escape through forces it first
+struct lthunk {
+	lval* code;
+	struct lchunk* chunk;
+	lval* fn;
+	lval** frame;
+	int frame_count;
+};
+
+//the parameters of lambdas nested in the body being closed over, or
+//a name bound by a let around it, whose symbol holds its slot
+typedef struct lscope {
+	lval* formals;
+	lval* sym;
+	struct lscope* up;
+} lscope;
+
+//one entry of an explicit work stack, what the fields hold is up to
+//the algorithm using it
+typedef struct {
+	lval* v;
+	lval* x;
+	mpc_ast_t* t;
+	int i;
+	lscope* scope;
+} lwork;
+
+//work stacks start in a small buffer and move to the heap once they
+//outgrow it, so nesting depth is only limited by memory
+#define LSTACK_LOCAL 16
+
+typedef struct {
+	int count;
+	int cap;
+	lwork* items;
+	lwork local[LSTACK_LOCAL];
+} lstack;
+
+//bytecode for the stack vm, every instruction is an opcode followed
+//by one operand which indexes the chunk's constant pools, or for
+//jumps is the index of the instruction to continue at
+enum { OP_NUM, OP_CONST, OP_SYM, OP_CALL, OP_JIT,
+	   OP_JUMP, OP_IF, OP_AND, OP_OR, OP_TREE,
+	   OP_DEF, OP_WHILE, OP_DOTIMES, OP_FOREACH,
+	   OP_STORE, OP_LOAD, OP_TAKE, OP_FUN, OP_CALLF, OP_EVAL,
+	   OP_THUNK, OP_CALLT, OP_BIND, OP_UNBIND, OP_TAIL, OP_TAILF };
+
+//native code for an arithmetic region, returns 0 to bail out
+typedef int(*ljitfn)(const long* in, long* out);
+
+//a region of arithmetic and comparisons inside a chunk. Everything in
+//it is an integer once its leaf symbols are, so it runs on raw longs
+//from its integer code, and is compiled to x86-64 instead once it has
+//run JIT_HOT times with the jit on
+typedef struct {
+	lval* src;
+	int end;
+	int runs;
+
+	//symbols read by the region, leaves are passed in by value and
+	//heads must still name the builtin the code was generated for
+	int syms_count;
+	lval** syms;
+	int heads_count;
+	lval** heads;
+	lbuiltin* funs;
+
+	//postfix integer code, pairs of INT_* and operand, and the deepest
+	//its stack gets
+	int ints_count;
+	long* ints;
+	int ints_depth;
+
+	ljitfn fn;
+	size_t size;
+} ljit;
+
+//integer code: a literal, the value of syms[i], and operators on the
+//top two values (or the top one for INT_NEG)
+enum { INT_NUM, INT_SYM, INT_NEG, INT_ADD, INT_SUB, INT_MUL, INT_DIV,
+	   INT_GT, INT_LT, INT_GE, INT_LE, INT_EQ, INT_NE };
+
+#define JIT_HOT 8
+
+//machine code buffer and the rel32 offsets that jump to the bail out
+typedef struct {
+	int count;
+	unsigned char* code;
+	int bails_count;
+	int* bails;
+} lasm;
+
+//condition codes for lasm_bail
+#define JO 0x80
+#define JE 0x84
+
+//a loop inside a chunk, its condition (while) or the variable it
+//binds (dotimes, foreach) and its body are compiled once with it
+typedef struct {
+	lval* sym;
+	struct lchunk* cond;
+	struct lchunk* body;
+} lloop;
+
+//a pure builtin application that a chunk computes more than once, the
+//first evaluation that always runs stores its value in a temporary
+//that the others load, the last of them without copying it. count is
+//how many occurrences are left to compile
+typedef struct {
+	unsigned long hash;
+	lval* v;
+	int count;
+	int stored;
+} lcse;
+
+typedef struct lchunk {
+	int count;
+	int* code;
+
+	int loops_count;
+	lloop* loops;
+
+	//arguments of calls of lazy lambdas, compiled to run when forced
+	int thunks_count;
+	struct lchunk** thunks;
+
+	//jit regions, region_depth is only used while compiling
+	int jits_count;
+	ljit* jits;
+	int region_depth;
+
+	//unboxed number literals and any other constant lvals
+	int nums_count;
+	long* nums;
+	int consts_count;
+	lval** consts;
+
+	//deepest the operand stack gets while running this chunk
+	int depth;
+
+	//temporaries for common subexpressions. The applications they
+	//hold and how deep in if branches or and/or arguments the code
+	//being compiled is are only used while compiling
+	int temps;
+	int cses_count;
+	lcse* cses;
+	int lazy;
+} lchunk;
+
+//code eval has compiled in vm mode, with a copy of the Q-expression
+//it was for and its hash. src is the last global value it was found
+//for, which finds it again without hashing while no binding has
+//changed since. macros is the number of macros defined before it was
+//compiled, it is compiled again after another one. running counts the
+//runs of it in progress, which stop it being replaced
+typedef struct {
+	unsigned long hash;
+	lval* code;
+	lchunk* chunk;
+	lval* src;
+	long version;
+	long macros;
+	int running;
+} leval;
+
+#define EVAL_CACHE 64
+#define EVAL_DEPTH 64
+
+//operand stack slot, numbers stay unboxed and v is NULL for them. A
+//builtin at the head of a call never escapes it, so OP_FUN pushes it
+//as fun without copying it and only OP_CALLF reads fun
+typedef struct {
+	lval* v;
+	long num;
+	lbuiltin fun;
+} vslot;
+
+//operand stacks and lambda arguments of up to this many values are
+//kept on the C stack
+#define VM_LOCAL 16
+
+//state for translating a file to C with --emit-c
+typedef struct {
+	FILE* out;
+	lenv* e;
+	int temps;
+	int labels;
+
+	//set when def or a loop is used in a way that can bind any name,
+	//otherwise defs lists every name they bind anywhere in the file.
+	//dotimes and foreach bind their variable globally like def
+	int dynamic;
+	int defs_count;
+	char** defs;
+	//set when the file defines macros, any call that isn't of a
+	//builtin might be one. The same goes for lazy lambdas
+	int macros;
+	int lazy;
+
+	//symbol constants, builtins called directly and globals that are
+	//known to hold numbers, which are mirrored in unboxed longs
+	int syms_count;
+	char** syms;
+	int funs_count;
+	char** funs;
+	int nums_count;
+	char** nums;
+} lemit;
+
+//evaluate through the bytecode vm unless started with --tree
+int use_vm = 1;
 
-lval* lval_eval_sexpr(lval* v);
-lval* lval_eval(lval* v);
+//set by the jit builtin, 2 also checks every native result
+int use_jit = 0;
+
+//print every expression after constant folding, set by --dump-fold
+int dump_fold = 0;
+
+//inline calls to small lambdas unless started with --no-inline,
+//--dump-inline prints every call that is
+int use_inline = 1;
+int dump_inline = 0;
+
+//inline cache hits and misses of lenv_lookup, read with the ic builtin
+long ic_hits = 0;
+long ic_misses = 0;
+
+//lvals allocated, the bytes allocated for them and loop bodies run so
+//far, bench reports all three
+long lval_allocs = 0;
+long lval_bytes = 0;
+long loop_iters = 0;
+
+//heap allocations saved on values that never escape the expression or
+//call using them: symbol nodes reused for their value, builtin heads
+//and lambda frames and arguments kept on the C stack, and literals
+//shared rather than copied
+long allocs_avoided = 0;
+
+
+lval* lval_eval(lenv* e, lval* v);
+lval* lval_eval_tail(lenv* e, lval* v, int tail);
+lval* lval_eval_sym(lenv* e, lval* v);
+lval* lval_apply(lenv* e, lval* v, lval** tail);
+int lval_tail(lval* f);
+lval* lval_invoke(lenv* e, lval* f, lval* a);
+lval* lval_run(lenv* e, lval* v);
+int lval_pure(lbuiltin f);
+int lval_special(lbuiltin f);
+int lval_impure(lenv* e, lval* v);
+lval* lval_fold(lenv* e, lval* v);
+int lval_deep(lval* v);
+lval* lval_fold_expr(lenv* e, lval* v);
+lval* lval_resolve(lenv* e, lval* v);
+lval* lval_inline_expr(lenv* e, lval* v);
+lval* lval_inline(lenv* e, lval* f, lval* v);
+int lval_inline_ok(lenv* e, lval* f, lval* g, lval* v);
+int lval_opaque(lenv* e, lval* f, lval* v);
+int lval_caller_local(lenv* e, lval* f, char* s);
+int lval_size(lval* v);
+lval* lval_subst(lclosure* c, lval* v, lval* args);
+lval* lval_subst_sym(lclosure* c, lval* v, lval* args);
+void lval_guard(lenv* e, lclosure* c);
+lval* lval_alloc(size_t size);
 lval* lval_num(long x);
+lval* lval_big(int sign, int count);
+lval* lval_big_long(long x);
+lval* lval_big_str(char* s);
+lval* lval_big_norm(lval* v);
+lval* lval_dbl(double x);
+int lval_number(lval* v);
+double lval_to_dbl(lval* v);
 lval* lval_err(char* m);
 lval* lval_sym(char* s);
 lval* lval_fun(lbuiltin func);
 lval* lval_sexpr(void); 
 lval* lval_qexpr(void); 
 lval* lval_read_num(mpc_ast_t* t);
+lval* lval_read_node(mpc_ast_t* t);
+int lval_read_skip(mpc_ast_t* t);
 lval* lval_read(mpc_ast_t* t);
+void lval_share(lval* v);
 lval* lval_add(lval* v, lval* x);
 lval* lval_pop(lval* v, int i);
 lval* lval_take(lval* v, int i);
+lval* lval_copy_node(lval* v);
 lval* lval_copy(lval* v);
-lval* builtin(lval* a, char* func);
-lval* builtin_op(lval* a, char* op);
-lval* builtin_head(lval* a);
-lval* builtin_tail(lval* a);
-lval* builtin_list(lval* a);
-lval* builtin_eval(lval* a);
-lval* builtin_join(lval* a);
+lval* lval_thaw(lval* v);
+int lval_eq(lval* x, lval* y);
+lval* builtin_op(lenv* e, lval* a, int op);
+lval* ldbl_op(lval* a, int op);
+lval* lbig_op(int op, lval* x, lval* y);
+int lbig_cmp(lval* x, lval* y);
+char* lbig_str(lval* v);
+void ldbl_str(char* s, double x);
+int lmag_cmp(const unsigned int* a, int an, const unsigned int* b, int bn);
+int lmag_add(const unsigned int* a, int an, const unsigned int* b, int bn, unsigned int* r);
+void lmag_sub(unsigned int* r, int rn, const unsigned int* b, int bn);
+void lmag_add_at(unsigned int* r, int rn, const unsigned int* b, int bn, int off);
+void lmag_mul(const unsigned int* a, int an, const unsigned int* b, int bn, unsigned int* r);
+void lmag_div(const unsigned int* a, int an, const unsigned int* b, int bn, unsigned int* q);
+unsigned int lmag_div_small(unsigned int* a, int an, unsigned int d);
+lval* builtin_add(lenv* e, lval* a);
+lval* builtin_sub(lenv* e, lval* a);
+lval* builtin_mul(lenv* e, lval* a);
+lval* builtin_div(lenv* e, lval* a);
+lval* builtin_ord(lenv* e, lval* a, int op);
+lval* builtin_gt(lenv* e, lval* a);
+lval* builtin_lt(lenv* e, lval* a);
+lval* builtin_ge(lenv* e, lval* a);
+lval* builtin_le(lenv* e, lval* a);
+lval* builtin_cmp(lenv* e, lval* a, int op);
+lval* builtin_eq(lenv* e, lval* a);
+lval* builtin_ne(lenv* e, lval* a);
+lval* builtin_if(lenv* e, lval* a);
+lval* builtin_logic(lenv* e, lval* a, int op);
+lval* builtin_and(lenv* e, lval* a);
+lval* builtin_or(lenv* e, lval* a);
+lval* builtin_while(lenv* e, lval* a);
+lval* builtin_dotimes(lenv* e, lval* a);
+lval* builtin_foreach(lenv* e, lval* a);
+lval* builtin_lambda(lenv* e, lval* a);
+lval* lval_lambda(lenv* e, lval* formals, lval* body);
+int lval_distinct(lval* formals);
+lval* lval_closure(lval* formals, lval* names, lval* vals, lval* body);
+void lval_convert(lenv* e, lval* f, lval* v);
+void lval_close(lenv* e, lval* f, lval* v, lscope* scope);
+void lval_close_sym(lenv* e, lval* f, lval* v, lscope* scope);
+void lval_close_push(lstack* s, lval* v, lscope* scope);
+lscope* lscope_new(lscope*** scopes, int* count, lval* formals, lval* sym, lscope* up);
+int lval_code_arg(lbuiltin f, int i);
+int lval_local(lval* f, char* s);
+int lval_let_slot(lenv* e, char* s);
+lval* builtin_let(lenv* e, lval* a);
+int lval_let_form(lval* v);
+lval* lval_call_fn(lenv* e, lval* f, lval* a);
+lval* lval_call_args(lenv* e, lval* f, lval** args, int count);
+lval* lval_call_frame(lenv* e, lval* f, lval** args, int count);
+int lval_lazy(lval* f);
+int lval_lazy_arg(lval* f, int i);
+lval* lval_thunk(lenv* e, lval* code, struct lchunk* chunk);
+void lval_force(lenv* e, lval* t);
+void lclosure_del(lclosure* c);
+lval* builtin_memo(lenv* e, lval* a);
+lval* builtin_memo_stats(lenv* e, lval* a);
+lval* lval_memo(lval* fn, int size);
+lval* lval_call_memo(lenv* e, lval* f, lval* a);
+void lmemo_touch(lmemo* m, int i);
+void lmemo_del(lmemo* m);
+lval* builtin_defmacro(lenv* e, lval* a);
+lval* builtin_macro_stats(lenv* e, lval* a);
+int lval_macro(lval* f);
+lval* lval_template(lclosure* c, lval* a);
+lval* lval_template_subst(lval* formals, lval* a, lval* v);
+lval* lval_template_sym(lval* formals, lval* a, lval* v);
+lval* lval_expand_call(lenv* e, lval* f, lval* a);
+lval* lval_expand(lenv* e, lval* f, lval* v);
+lval* lval_expand_code(lenv* e, lval* f, lval* v);
+void lval_unclose(lval* v);
+lval* builtin_specialize(lenv* e, lval* a);
+lval* lval_specialize(lenv* e, lval* f, lval* a);
+lval* lval_peval(lenv* e, lval** slots, lval* v, int data);
+lval* lval_peval_expr(lenv* e, lval** slots, lval* v);
+lval* lval_while(lenv* e, lchunk* cond, lchunk* body);
+lval* lval_dotimes(lenv* e, lval* k, lval* n, lchunk* body);
+lval* lval_foreach(lenv* e, lval* k, lval* l, lchunk* body);
+lval* lval_loop(lenv* e, lchunk* body);
+lval* builtin_head(lenv* e, lval* a);
+lval* builtin_tail(lenv* e, lval* a);
+lval* builtin_list(lenv* e, lval* a);
+lval* builtin_eval(lenv* e, lval* a);
+lval* builtin_eval_stats(lenv* e, lval* a);
+lval* lval_eval_code(lenv* e, lval* x, int bound);
+int leval_find(lenv* e, lval* x, int bound);
+int lval_open(lval* v);
+lval* builtin_join(lenv* e, lval* a);
+lval* builtin_def(lenv* e, lval* a);
+lval* builtin_bench(lenv* e, lval* a);
+lval* builtin_jit(lenv* e, lval* a);
+lval* builtin_ic(lenv* e, lval* a);
+lval* builtin_print(lenv* e, lval* a);
+lval* lval_call(lenv* e, lbuiltin f, lval* a);
+void lval_load(lenv* e, mpc_parser_t* p, char* filename);
 lval* lval_join(lval* x, lval* y);
-void lval_expr_print(lval* v, char open, char close);
 void lval_print(lval* l);
 void lval_println(lval* v);
+void lval_print_formals(lclosure* c);
+void lval_del_node(lval* v);
 void lval_del(lval* v);
 
+void lstack_init(lstack* s);
+void lstack_push(lstack* s, lval* v, lval* x, mpc_ast_t* t, int i);
+void lstack_del(lstack* s);
+
 lenv* lenv_new(void);
 lval* lenv_get(lenv* e, lval* k);
+lval* lenv_lookup(lenv* e, lval* k);
+int lenv_slot(lenv* e, lval* k);
 void lenv_put(lenv* e, lval* k, lval* v);
+void lenv_put_num(lenv* e, lval* k, long x);
 void lenv_del(lenv* e);
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func);
+void lenv_add_builtins(lenv* e);
 
+lchunk* lchunk_new(void);
+void lchunk_del(lchunk* c);
+void lchunk_emit(lchunk* c, int op, int arg);
+int lchunk_const(lchunk* c, lval* v);
+int lchunk_thunk(lchunk* c, lchunk* t);
+lchunk* lval_compile(lenv* e, lval* v);
+void lval_compile_expr(lchunk* c, lenv* e, lval* v, int sp);
+int lval_compile_special(lchunk* c, lenv* e, lval* v, int sp);
+void lval_compile_branch(lchunk* c, lenv* e, lval* v, int sp);
+lchunk* lval_compile_code(lenv* e, lval* v);
+int lval_compile_deep(lchunk* c, lval* v, int code);
+void lchunk_tail(lchunk* c);
+lbuiltin lval_head(lenv* e, lval* v);
+unsigned long lval_hash(lval* v);
+int lval_stable(lenv* e, lval* v);
+int lval_cse_pure(lenv* e, lval* v);
+void lval_cse(lchunk* c, lenv* e, lval* v);
+void lval_cse_scan(lchunk* c, lenv* e, lval* v);
+int lchunk_cse(lchunk* c, lval* v, unsigned long h);
+int lchunk_cse_inside(lchunk* c, lval* v);
+int lval_compile_loop(lchunk* c, lenv* e, lbuiltin f, lval* v, int sp);
+lval* vslot_box(vslot s);
+int vm_op(lbuiltin f);
+int vm_arith(int op, vslot* a, int count, vslot* r);
+vslot vm_call(lenv* e, vslot* s, int count);
+int vm_tail(lenv* e, vslot* s, int count);
+vslot vm_def(lenv* e, lval* syms, vslot* s);
+vslot lchunk_value(lenv* e, lchunk* c);
+lval* lchunk_run(lenv* e, lchunk* c);
+lval* lval_exec(lenv* e, lval* v);
+
+lbuiltin jit_op(lval* v);
+int jit_region(lval* v);
+int ljit_add(lchunk* c, lval* v);
+void ljit_inputs(ljit* j, lval* v);
+void ljit_del(ljit* j);
+void lint_emit(ljit* j, long op, long arg);
+void lint_expr(ljit* j, lval* v, int sp);
+int ljit_load(lenv* e, ljit* j, long* in);
+int lint_run(lenv* e, ljit* j, long* out);
+void lasm_bytes(lasm* a, const char* bytes, int n);
+void lasm_imm(lasm* a, long x, int n);
+void lasm_bail(lasm* a, char cond);
+void lasm_expr(lasm* a, ljit* j, lval* v);
+int ljit_compile(ljit* j);
+vslot ljit_run(lenv* e, ljit* j);
+
+void lval_emit_c(mpc_parser_t* p, char* filename, FILE* out);
+int lemit_intern(char*** names, int* count, char* s);
+int lemit_find(char** names, int count, char* s);
+void lemit_scan(lemit* m, lval* v);
+int lemit_fun(lemit* m, lval* v);
+int lemit_numeric(lemit* m, lval* v, int* fails);
+int lemit_divisor(lval* v);
+int lemit_infallible(lemit* m, lval* v);
+void lemit_sym(lemit* m, char* s);
+int lemit_const(lemit* m, lval* v);
+int lemit_num(lemit* m, lval* v, int slow);
+int lemit_expr(lemit* m, lval* v);
+int lemit_apply(lemit* m, lval* v);
+void lemit_top(lemit* m, lval* v, int n);
+
+#ifndef LISPY_EMBED
 int main(int argc, char** argv) {
 	mpc_parser_t* Number    = mpc_new("number");
 	mpc_parser_t* Symbol    = mpc_new("symbol");
+	mpc_parser_t* Comment   = mpc_new("comment");
 	mpc_parser_t* Sexpr      = mpc_new("sexpr");
 	mpc_parser_t* Qexpr      = mpc_new("qexpr");
 	mpc_parser_t* Expr      = mpc_new("expr");
@@ -81,23 +650,50 @@ int main(int argc, char** argv) {
 
 	mpca_lang(MPCA_LANG_DEFAULT,
 	  "\
-	  number   : /-?[0-9]+/ ;            \
-	  symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;  \
-	  | \"list\" | \"head\" | \"tail\" | \"join\" | \"eval\" ; \
+	  number   : /-?[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?/ ; \
+	  symbol   : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&~]+/ ;  \
+	  comment  : /;[^\\r\\n]*/ ;          \
 	  sexpr    : '(' <expr>* ')' ;       \
 	  qexpr    : '{' <expr>* '}' ;       \
-	  expr     : <number> | <symbol> | <sexpr> | <qexpr> ; \
+	  expr     : <number> | <symbol> | <comment> | <sexpr> | <qexpr> ; \
 	  lispy    : /^/ <expr>* /$/ ; \
 	  ",
-	  Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+	  Number, Symbol, Comment, Sexpr, Qexpr, Expr, Lispy);
+
 
+	int emit = 0;
+	int files = 0;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--tree") == 0) { use_vm = 0; continue; }
+		if (strcmp(argv[i], "--emit-c") == 0) { emit = 1; continue; }
+		if (strcmp(argv[i], "--dump-fold") == 0) { dump_fold = 1; continue; }
+		if (strcmp(argv[i], "--no-inline") == 0) { use_inline = 0; continue; }
+		if (strcmp(argv[i], "--dump-inline") == 0) { dump_inline = 1; continue; }
+		files++;
+	}
 
-	puts("Lispy Version 0.0.0.0.1");
-	puts("Press Ctrl+c to Exit\n");
+	lenv* e = lenv_new();
+	lenv_add_builtins(e);
 
-	while (1) {
+	//run or translate any files given instead of starting the repl
+	for (int i = 1; i < argc && files; i++) {
+		if (strncmp(argv[i], "--", 2) == 0) { continue; }
+		if (emit) {
+			lval_emit_c(Lispy, argv[i], stdout);
+		} else {
+			lval_load(e, Lispy, argv[i]);
+		}
+	}
+
+	if (!files) {
+		puts("Lispy Version 0.0.0.0.1");
+		puts("Press Ctrl+c to Exit\n");
+	}
+
+	while (!files) {
 		//read a line of user input
 		char* input = readline("lispy> ");
+		if (input == NULL) { break; }
 
 		//add input to history
 		add_history(input);
@@ -106,7 +702,8 @@ int main(int argc, char** argv) {
 		mpc_result_t r;
 
 		if (mpc_parse("<stdin>", input, Lispy, &r)) {
-			lval* x = lval_eval(lval_read(r.output));
+			lval* x = lval_read(r.output);
+			x = lval_run(e, x);
 			lval_println(x);
 			lval_del(x);
 			//lval result = eval(r.output);
@@ -120,18 +717,142 @@ int main(int argc, char** argv) {
 		free(input);
 	}
 
-	mpc_cleanup(6, Number, Symbol, Sexpr, Qexpr, Expr, Lispy);
+	lenv_del(e);
+	mpc_cleanup(7, Number, Symbol, Comment, Sexpr, Qexpr, Expr, Lispy);
 	return 0;
 }
+#endif
 
 
 
-lval* lval_eval_sexpr(lval* v) {
-	//evaluate children
-	for (int i = 0; i < v->count; i++) {
-		v->cell[i] = lval_eval(v->cell[i]);
+lval* lval_eval(lenv* e, lval* v) {
+	return lval_eval_tail(e, v, 0);
+}
+
+//evaluate without recursing on the C stack: a frame is pushed for
+//every S-expression being evaluated, holding the index of the child
+//being worked on, and popped again once it has been applied. With
+//tail set v is the body of the running lambda, and a lambda call it
+//ends in is left in e->tail with NULL returned
+lval* lval_eval_tail(lenv* e, lval* v, int tail) {
+	if (v->type == LVAL_SYM) { return lval_eval_sym(e, v); }
+	if (v->type != LVAL_SEXPR) { return v; }
+
+	lstack s;
+	lstack_init(&s);
+
+	while (1) {
+		//descend to the first thing that isn't an S-expression
+		//an S-expression is taken apart as it is evaluated, so it
+		//can't be a shared literal
+		lval* x = v;
+		if (v->type == LVAL_SEXPR && v->count > 0) {
+			v = lval_thaw(v);
+			lstack_push(&s, v, NULL, NULL, 0);
+			v = v->cell[0];
+			continue;
+		}
+		if (v->type == LVAL_SYM) { x = lval_eval_sym(e, v); }
+
+		//hand the value up, applying every S-expression whose children
+		//are done, until one still has children left to evaluate
+		while (1) {
+			if (s.count == 0) {
+				lstack_del(&s);
+				return x;
+			}
+			lwork* w = &s.items[s.count-1];
+			w->v->cell[w->i++] = x;
+
+			//special forms get the rest of their expression unevaluated
+			//and hand back what to evaluate in its place
+			if (w->i == 1 && w->v->count > 1 && x->type == LVAL_FUN
+				&& lval_special(x->fun)) {
+				s.count--;
+				lval* f = lval_pop(w->v, 0);
+				v = f->fun(e, w->v);
+				lval_del(f);
+				break;
+			}
+
+			//and so do macros, code that wasn't expanded before it ran
+			//is expanded here
+			if (w->i == 1 && w->v->count > 1 && lval_macro(x)) {
+				s.count--;
+				lval* f = lval_pop(w->v, 0);
+				v = lval_expand_call(e, f, w->v);
+				lval_del(f);
+				break;
+			}
+
+			//arguments a lambda takes lazily are left for it to evaluate
+			//when it needs them
+			while (w->i < w->v->count && lval_lazy_arg(w->v->cell[0], w->i-1)) {
+				w->v->cell[w->i] = lval_thunk(e, w->v->cell[w->i], NULL);
+				w->i++;
+			}
+
+			if (w->i < w->v->count) {
+				v = w->v->cell[w->i];
+				break;
+			}
+
+			//the call the whole body comes down to, after the taken
+			//branches of ifs, is made by the caller once this frame is
+			//gone
+			s.count--;
+			if (tail && s.count == 0 && w->v->count > 1 && lval_tail(w->v->cell[0])) {
+				int ok = 1;
+				for (int i = 1; i < w->v->count; i++) {
+					ok &= w->v->cell[i]->type != LVAL_ERR && w->v->cell[i]->type != LVAL_THUNK;
+				}
+				if (ok) {
+					e->tail = w->v;
+					lstack_del(&s);
+					return NULL;
+				}
+			}
+
+			//a tail call comes back as the expression to evaluate in
+			//place of this one, so it takes no frame
+			x = lval_apply(e, w->v, &v);
+			if (x == NULL) { break; }
+		}
+	}
+}
+
+//the value of a symbol, which is consumed. A number or function is
+//written over the symbol's own node rather than copied into a new one
+lval* lval_eval_sym(lenv* e, lval* v) {
+	lval* x = lenv_lookup(e, v);
+	if (x == NULL || (x->type != LVAL_NUM && x->type != LVAL_DBL
+		&& x->type != LVAL_FUN)) {
+		x = x ? lval_copy(x) : lval_err("Unbound symbol!");
+		lval_del(v);
+		return x;
+	}
+
+	free(v->sym);
+	v->type = x->type;
+	if (x->type == LVAL_NUM) {
+		v->num = x->num;
+	} else if (x->type == LVAL_DBL) {
+		v->dbl = x->dbl;
+	} else {
+		v->fun = x->fun;
+		v->closure = x->closure;
+		v->memo = x->memo;
+		if (v->closure) { v->closure->refs++; }
+		if (v->memo) { v->memo->refs++; }
 	}
+	allocs_avoided++;
+	return v;
+}
 
+//apply an S-expression whose children have all been evaluated. eval
+//of a Q-expression is a tail call, its expression is handed back
+//through tail and NULL is returned
+lval* lval_apply(lenv* e, lval* v, lval** tail) {
 	//Error checking
 	for (int i = 0; i < v->count; i++) {
 		if (v->cell[i]->type == LVAL_ERR) {
@@ -140,7 +861,7 @@ lval* lval_eval_sexpr(lval* v) {
 	}
 
 	//Empty expression
-	if (v->count == 0) { return 0; }
+	if (v->count == 0) { return v; }
 
 	//single expression
 	if (v->count == 1) { 
@@ -155,429 +876,4848 @@ lval* lval_eval_sexpr(lval* v) {
 		return lval_err("First element is not a function");
 	}
 
+	//anything builtin_eval would reject goes through it for the error
+	if (f->fun == builtin_eval && v->count == 1
+		&& v->cell[0]->type == LVAL_QEXPR) {
+		lval_del(f);
+		*tail = lval_thaw(lval_take(v, 0));
+		(*tail)->type = LVAL_SEXPR;
+		return NULL;
+	}
+
 	//call function to get result
-	lval* result = f->fun(e, v);
+	lval* result = lval_invoke(e, f, v);
 	lval_del(f);
 	return result;
 }
 
-lval* lval_eval(lval* v) {
-
-	if (v->type == LVAL_SYM) {
-		lval* x = lenv_get(e, v);
-		lval_del(v);
-		return x;
-	}
+//can a call of f be made after the frame of the caller is gone: a
+//lambda that isn't memoized and takes no argument lazily, as a thunk
+//would still read the caller's frame
+int lval_tail(lval* f) {
+	return f->type == LVAL_FUN && f->closure && f->memo == NULL && f->closure->lazy == NULL;
+}
 
-	//evaluate Sexpressions
-	if (v->type == LVAL_SEXPR) {
-		return lval_eval_sexpr(v);
+//call a builtin, lambda or memoized function on the arguments in a
+lval* lval_invoke(lenv* e, lval* f, lval* a) {
+	if (lval_macro(f)) {
+		lval_del(a);
+		return lval_err("Macro called on evaluated arguments!");
 	}
-	return v;
+	if (f->memo) { return lval_call_memo(e, f, a); }
+	return f->closure ? lval_call_fn(e, f, a) : f->fun(e, a);
 }
 
-//construct a pointer to a new number lval
-lval* lval_num(long x) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_NUM;
-	v->num = x;
-	return v;
+//evaluate an expression that has just been read
+lval* lval_run(lenv* e, lval* v) {
+	if (!lval_deep(v)) { v = lval_expand(e, NULL, v); }
+	v = lval_resolve(e, lval_fold(e, lval_inline_expr(e, v)));
+	if (dump_fold) {
+		printf("fold: ");
+		lval_println(v);
+	}
+	return use_vm ? lval_exec(e, v) : lval_eval(e, v);
 }
 
-lval* lval_fun(lbuiltin func) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_FUN;
-	v->fun = func;
-	return v;
+//builtins whose result depends only on their arguments
+int lval_pure(lbuiltin f) {
+	return f == builtin_add || f == builtin_sub || f == builtin_mul
+		|| f == builtin_div || f == builtin_gt || f == builtin_lt
+		|| f == builtin_ge || f == builtin_le || f == builtin_eq
+		|| f == builtin_ne || f == builtin_head || f == builtin_tail
+		|| f == builtin_list || f == builtin_join;
 }
 
-//construct a pointer to a new error lval
-lval* lval_err(char* m) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_ERR;
-	v->err = malloc(strlen(m) + 1);
-	strcpy(v->err, m);
-	return v;
+//builtins that take their arguments unevaluated and return an
+//expression for the caller to evaluate in their place. Evaluating a
+//value gives the value back, so they can also be applied to values
+int lval_special(lbuiltin f) {
+	return f == builtin_if || f == builtin_and || f == builtin_or
+		|| f == builtin_def || f == builtin_while || f == builtin_dotimes
+		|| f == builtin_foreach || f == builtin_lambda || f == builtin_let;
 }
 
-//construct a pointer to a new symbol lval
-lval* lval_sym(char* s) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SYM;
-	v->sym = malloc(strlen(s) + 1);
-	strcpy(v->sym, s);
-	return v;
+//does v mention anything that can change the environment, including
+//inside Q-expressions since those might be evaluated. Any lambda might
+//do either when called
+int lval_impure(lenv* e, lval* v) {
+	int r = 0;
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+	while (s.count && !r) {
+		lval* x = s.items[--s.count].v;
+		if (x->type == LVAL_SYM) {
+			int i = lenv_slot(e, x);
+			lval* f = i != -1 ? e->vals[i] : NULL;
+			r = f && f->type == LVAL_FUN && (f->fun == NULL || f->fun == builtin_def
+				|| f->fun == builtin_defmacro || f->fun == builtin_eval || f->fun == builtin_bench);
+		}
+		if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+			for (int i = 0; i < x->count; i++) { lstack_push(&s, x->cell[i], NULL, NULL, 0); }
+		}
+	}
+	lstack_del(&s);
+	return r;
 }
 
-//a pointer to a new empty Sexpr lval
-lval* lval_sexpr(void) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_SEXPR;
-	v->count = 0;
-	v->cell = NULL;
-	return v;
+//replace pure builtin applications on constant arguments with their
+//value. Expressions that can redefine names are left alone
+lval* lval_fold(lenv* e, lval* v) {
+	return lval_deep(v) || lval_impure(e, v) ? v : lval_fold_expr(e, v);
 }
 
-//a pointer to a new empty Qexpr lval
-lval* lval_qexpr(void) {
-	lval* v = malloc(sizeof(lval));
-	v->type = LVAL_QEXPR;
-	v->count = 0;
-	v->cell = NULL;
-	return v;
-}
+//the passes that rewrite code recurse on the C stack, code nested
+//deeper than this is run as it is
+#define CODE_DEPTH 1000
 
-lval* lval_read_num(mpc_ast_t* t) {
-	errno = 0;
-	long x = strtol(t->contents, NULL, 10);
-	return errno != ERANGE ?
-		lval_num(x) : lval_err("invalid number");
+//is v nested more than CODE_DEPTH lists deep
+int lval_deep(lval* v) {
+	int r = 0;
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+	while (s.count && !r) {
+		lwork w = s.items[--s.count];
+		r = w.i > CODE_DEPTH;
+		if (w.v->type != LVAL_SEXPR && w.v->type != LVAL_QEXPR) { continue; }
+		for (int i = 0; i < w.v->count; i++) {
+			lstack_push(&s, w.v->cell[i], NULL, NULL, w.i + 1);
+		}
+	}
+	lstack_del(&s);
+	return r;
 }
 
-lval* lval_read(mpc_ast_t* t) {
-	//if symbol or number return our token converted to that type
-	if (strstr(t->tag, "number")) { return lval_read_num(t); }
-	if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+//applications that fail are kept so the error is raised in its usual
+//place, Q-expressions are data and never folded into
+lval* lval_fold_expr(lenv* e, lval* v) {
+	if (v->type != LVAL_SEXPR) { return v; }
 
-	//if root (>) or sexpr then create empty list
-	lval* x = NULL;
-	if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-	if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
-	if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+	for (int i = 0; i < v->count; i++) {
+		v->cell[i] = lval_fold_expr(e, v->cell[i]);
+	}
+	if (v->count < 2 || v->cell[0]->type != LVAL_SYM) { return v; }
 
-	//fill this list with any valid expression contained within
-	for (int i = 0; i < t->children_num; i++) {
-		if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-		if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-		if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-		if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
-		if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-		x = lval_add(x, lval_read(t->children[i]));
+	int slot = lenv_slot(e, v->cell[0]);
+	lval* f = slot != -1 ? e->vals[slot] : NULL;
+	if (f == NULL || f->type != LVAL_FUN || !lval_pure(f->fun)) { return v; }
+	for (int i = 1; i < v->count; i++) {
+		int t = v->cell[i]->type;
+		if (!lval_number(v->cell[i]) && t != LVAL_QEXPR) { return v; }
 	}
 
+	lval* x = lval_eval(e, lval_copy(v));
+	if (x->type == LVAL_ERR) {
+		lval_del(x);
+		return v;
+	}
+	lval_del(v);
 	return x;
 }
 
-lval* lval_add(lval* v, lval* x) {
-	v->count++;
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-	v->cell[v->count-1] = x;
-	return v;
-}
-
-lval* lval_pop(lval* v, int i) {
-	//find item at i
-	lval* x = v->cell[i];
+//fill the inline cache of every symbol outside Q-expressions. An
+//unbound symbol is an error right away unless v could still define it
+//or it is an argument of a special form or lazy lambda, which might
+//never evaluate it
+lval* lval_resolve(lenv* e, lval* v) {
+	int unbound = 0;
 
-	//shift memory after the item at i
-	memmove(&v->cell[i], &v->cell[i+1],
-			sizeof(lval*) * (v->count-i-1));
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
 
-	//decrease the count of items in the list
-	v->count--;
+	while (s.count) {
+		lwork w = s.items[--s.count];
+		lval* x = w.v;
+		if (x->type == LVAL_SYM) {
+			x->slot = lenv_slot(e, x);
+			x->version = x->slot != -1 ? e->version : -1;
+			if (x->slot == -1 && !w.i) { unbound = 1; }
+		}
+		if (x->type == LVAL_SEXPR) {
+			int k = x->count > 1 && x->cell[0]->type == LVAL_SYM
+				? lenv_slot(e, x->cell[0]) : -1;
+			int lazy = k != -1 && e->vals[k]->type == LVAL_FUN
+				&& (lval_special(e->vals[k]->fun) || lval_macro(e->vals[k])
+				|| lval_lazy(e->vals[k]));
+			for (int i = 0; i < x->count; i++) {
+				lstack_push(&s, x->cell[i], NULL, NULL, w.i || (lazy && i > 0));
+			}
+		}
+	}
+	lstack_del(&s);
 
-	//reallocate the memory used
-	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-	return x;
+	if (unbound && !lval_impure(e, v)) {
+		lval_del(v);
+		return lval_err("Unbound symbol!");
+	}
+	return v;
 }
 
-lval* lval_take(lval* v, int i) {
-	lval* x = lval_pop(v, i);
+//inline calls in an expression that is about to run, unless the code
+//that is left could run a lambda or change bindings first. A def only
+//binds once its values are computed, so only those are checked
+lval* lval_inline_expr(lenv* e, lval* v) {
+	if (!use_inline || v->type != LVAL_SEXPR || lval_deep(v)) { return v; }
+
+	lval* x = lval_inline(e, NULL, lval_copy(v));
+	int k = x->count > 0 && x->cell[0]->type == LVAL_SYM
+		? lenv_slot(e, x->cell[0]) : -1;
+	int def = k != -1 && e->vals[k]->type == LVAL_FUN
+		&& e->vals[k]->fun == builtin_def;
+	int opaque = def ? 0 : lval_opaque(e, NULL, x);
+	for (int i = 2; def && i < x->count; i++) {
+		if (lval_opaque(e, NULL, x->cell[i])) { opaque = 1; }
+	}
+
+	if (opaque || lval_eq(x, v)) {
+		lval_del(x);
+		return v;
+	}
+	if (dump_inline) {
+		printf("inline: ");
+		lval_print(v);
+		printf(" -> ");
+		lval_println(x);
+	}
 	lval_del(v);
 	return x;
 }
 
-lval* builtin(lval* a, char* func) {
-	if (strcmp("list", func) == 0) { return builtin_list(a); }
-	if (strcmp("head", func) == 0) { return builtin_head(a); }
-	if (strcmp("tail", func) == 0) { return builtin_tail(a); }
-	if (strcmp("join", func) == 0) { return builtin_join(a); }
-	if (strcmp("eval", func) == 0) { return builtin_eval(a); }
-	if (strcmp("+-/*", func)) { return builtin_op(a, func); }
-	lval_del(a);
-	return lval_err("Unknown Function!");
-}
-
-lval* builtin_op(lval* a, char* op) {
-	//ensure all arguments are numbers
-	for (int i = 0; i < a->count; i++) {
-		 if (a->cell[i]->type != LVAL_NUM) {
-			 lval_del(a);
-			 return lval_err("Cannon operate on non-number");
-		 }
-	}
+//lambdas whose body is at most this many values are inlined
+#define INLINE_BUDGET 24
 
-	//pop first element
-	lval* x = lval_pop(a, 0);
+//replace calls of small lambdas in code v with their bodies. When
+//inlining into the body of lambda f what was inlined is recorded in
+//its closure so calls can check it is still current. Nested lambdas
+//inline their own calls when they are created
+lval* lval_inline(lenv* e, lval* f, lval* v) {
+	if ((v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) || v->refs) { return v; }
 
-	//if no arguments and sub, then perform unary negation
-	if ((strcmp(op, "-") == 0) && a->count == 0) {
-		x->num = -x->num;
+	int k = v->count > 0 && v->cell[0]->type == LVAL_SYM
+		? lenv_slot(e, v->cell[0]) : -1;
+	lval* g = k != -1 && e->vals[k]->type == LVAL_FUN ? e->vals[k] : NULL;
+	if (g && g->fun == builtin_lambda) { return v; }
+	for (int i = 0; i < v->count; i++) {
+		if (v->cell[i]->type != LVAL_QEXPR || lval_code_arg(g ? g->fun : NULL, i)) {
+			v->cell[i] = lval_inline(e, f, v->cell[i]);
+		}
+	}
+	if (g && g->fun == builtin_let && lval_let_form(v)) {
+		lval* b = v->cell[1];
+		for (int i = 1; i < b->count; i += 2) {
+			if (b->cell[i]->type != LVAL_QEXPR) { b->cell[i] = lval_inline(e, f, b->cell[i]); }
+		}
 	}
+	//a list of one value is that value rather than a call
+	if (g == NULL || g->closure == NULL || v->count < 2
+		|| !lval_inline_ok(e, f, g, v)) { return v; }
 
-	//while there are still elements remaining
-	while (a->count > 0) {
-		//pop the next element
-		lval* y = lval_pop(a, 0);
+	//the body keeps the type of the call, an if branch stays a
+	//Q-expression
+	lclosure* c = g->closure;
+	lval_guard(e, c);
+	lval* x = lval_subst(c, lval_thaw(lval_copy(c->body)), v);
+	x->type = v->type;
 
-		if (strcmp(op, "+") == 0) { x->num += y->num; }
-		if (strcmp(op, "-") == 0) { x->num -= y->num; }
-		if (strcmp(op, "*") == 0) { x->num *= y->num; }
-		if (strcmp(op, "/") == 0) {
-			if (y->num == 0) {
-				lval_del(x);
-				lval_del(y);
-				x = lval_err("Division By Zero!");
-				break;
-			}
-			x->num /= y->num;
+	if (f) {
+		lclosure* d = f->closure;
+		lval_add(d->inlined, lval_sym(v->cell[0]->sym));
+		lval_add(d->callees, lval_copy(g));
+		for (int i = 0; c->outline && i < c->inlined->count; i++) {
+			lval_add(d->inlined, lval_copy(c->inlined->cell[i]));
+			lval_add(d->callees, lval_copy(c->callees->cell[i]));
 		}
-		lval_del(y);
 	}
-
-	lval_del(a);
+	lval_del(v);
 	return x;
 }
 
-lval* builtin_head(lval* a) {
-	//check error conditions
-	if (a->count != 1) {
-		return lval_err("Function 'head' passed too many arguments!");
-	}
-	if (a->cell[0]->type != LVAL_QEXPR) {
-		return lval_err("Function 'head' passed incorrect types!");
-	}
-	if (a->cell[0]->count == 0) {
-		return lval_err("Function 'head' passed {}!");
-	}
+//g can be inlined at the call v if its body is small and only uses
+//builtins that neither bind names nor run other code, none of its
+//globals are hidden by locals at the call, and every argument is a
+//number or a bound symbol so it can be evaluated where it is used.
+//A body calling no lambdas can't be recursive
+int lval_inline_ok(lenv* e, lval* f, lval* g, lval* v) {
+	lclosure* c = g->closure;
+	int n = c->formals->count;
+	if (v->count-1 != n || c->lets->count
+		|| lval_caller_local(e, f, v->cell[0]->sym)) { return 0; }
+	if (lval_size(c->body) > INLINE_BUDGET || lval_opaque(e, NULL, c->body)) { return 0; }
 
-	//otherwise take first argument
-	lval* v = lval_take(a, 0);
-
-	//delete all elements that are not head and return
-	while (v->count > 1) {
-		lval_del(lval_pop(v, 1));
+	for (int i = 1; i < v->count; i++) {
+		lval* a = v->cell[i];
+		if (a->type == LVAL_NUM) { continue; }
+		if (a->type != LVAL_SYM) { return 0; }
+		if (lenv_slot(e, a) == -1 && !lval_caller_local(e, f, a->sym)) { return 0; }
 	}
-	return v;
-}
 
-lval* builtin_tail(lval* a) {
-	//check error conditions
-	if (a->count != 1) {
-		return lval_err("Function 'tail' passed too many arguments!");
-	}
-	if (a->cell[0]->type != LVAL_QEXPR) {
-		return lval_err("Function 'tail' passed incorrect types!");
-	}
-	if (a->cell[0]->count == 0) {
-		return lval_err("Function 'tail' passed {}!");
-	}
+	int ok = 1;
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, c->body, NULL, NULL, 0);
+	while (s.count && ok) {
+		lval* x = s.items[--s.count].v;
+		if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+			for (int i = 0; i < x->count; i++) {
+				lstack_push(&s, x->cell[i], NULL, NULL, 0);
+			}
+		}
+		if (x->type != LVAL_SYM) { continue; }
 
-	//otherwise take first argument
-	lval* v = lval_take(a, 0);
+		//captured values are substituted too, only numbers are safe
+		//to put in code
+		if (x->local >= n) {
+			ok = c->vals->cell[x->local - n]->type == LVAL_NUM;
+			continue;
+		}
+		if (x->local != -1) { continue; }
 
-	//delete all elements that are not head and return
-	lval_del(lval_pop(v, 0));
-	return v;
+		int k = lenv_slot(e, x);
+		lval* y = k != -1 && e->vals[k]->type == LVAL_FUN ? e->vals[k] : NULL;
+		if (lval_caller_local(e, f, x->sym)) { ok = 0; }
+		if (y && (y->fun == NULL || y->fun == builtin_def
+			|| y->fun == builtin_defmacro || y->fun == builtin_eval
+			|| y->fun == builtin_bench || y->fun == builtin_lambda
+			|| y->fun == builtin_while || y->fun == builtin_dotimes
+			|| y->fun == builtin_foreach)) { ok = 0; }
+	}
+	lstack_del(&s);
+	return ok;
 }
 
+//could running code v call a lambda or change bindings: any call of
+//something but a builtin, or of def, eval or bench
+int lval_opaque(lenv* e, lval* f, lval* v) {
+	int r = 0;
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+	while (s.count && !r) {
+		lval* x = s.items[--s.count].v;
+		if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { continue; }
 
-lval* builtin_list(lval* a) {
+		lbuiltin h = NULL;
+		if (x->count > 0 && x->cell[0]->type == LVAL_SYM && x->cell[0]->local == -1
+			&& !lval_caller_local(e, f, x->cell[0]->sym)) {
+			int k = lenv_slot(e, x->cell[0]);
+			h = k != -1 && e->vals[k]->type == LVAL_FUN ? e->vals[k]->fun : NULL;
+		}
+		if (h == builtin_lambda) { continue; }
+		if (x->count > 1 && (h == NULL || h == builtin_def || h == builtin_defmacro
+			|| h == builtin_eval || h == builtin_bench)) {
+			r = 1;
+			break;
+		}
+
+		for (int i = 0; i < x->count; i++) {
+			if (x->cell[i]->type != LVAL_QEXPR || lval_code_arg(h, i)) {
+				lstack_push(&s, x->cell[i], NULL, NULL, 0);
+			}
+		}
+		if (h == builtin_let && lval_let_form(x)) {
+			lval* b = x->cell[1];
+			for (int i = 1; i < b->count; i += 2) {
+				if (b->cell[i]->type != LVAL_QEXPR) { lstack_push(&s, b->cell[i], NULL, NULL, 0); }
+			}
+		}
+	}
+	lstack_del(&s);
+	return r;
+}
+
+//does s name an argument, let or captured variable of f, or a
+//variable of the lambda running now which f would capture
+int lval_caller_local(lenv* e, lval* f, char* s) {
+	lval* g[2] = { f, e->fn };
+	for (int i = 0; i < 2; i++) {
+		if (g[i] == NULL) { continue; }
+		if (lval_local(g[i], s) != -1) { return 1; }
+		lval* lets = g[i]->closure->lets;
+		for (int j = 0; j < lets->count; j++) {
+			if (strcmp(lets->cell[j]->sym, s) == 0) { return 1; }
+		}
+	}
+	return 0;
+}
+
+//number of values in v
+int lval_size(lval* v) {
+	int n = 0;
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+	while (s.count) {
+		lval* x = s.items[--s.count].v;
+		n++;
+		if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+			for (int i = 0; i < x->count; i++) { lstack_push(&s, x->cell[i], NULL, NULL, 0); }
+		}
+	}
+	lstack_del(&s);
+	return n;
+}
+
+//replace the arguments of closure c in a copy of its body v with the
+//arguments of the call args, and what it captured with the values
+lval* lval_subst(lclosure* c, lval* v, lval* args) {
+	if (v->type == LVAL_SYM) { return lval_subst_sym(c, v, args); }
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+	while (s.count) {
+		lval* x = s.items[--s.count].v;
+		if ((x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) || x->refs) { continue; }
+		//what was substituted is left as it is
+		for (int i = 0; i < x->count; i++) {
+			lval* y = x->cell[i];
+			if (y->type == LVAL_SYM) {
+				x->cell[i] = lval_subst_sym(c, y, args);
+			} else {
+				lstack_push(&s, y, NULL, NULL, 0);
+			}
+		}
+	}
+	lstack_del(&s);
+	return v;
+}
+
+//the value for v if it is a symbol lval_subst replaces
+lval* lval_subst_sym(lclosure* c, lval* v, lval* args) {
+	if (v->type != LVAL_SYM || v->local == -1) { return v; }
+	int n = c->formals->count;
+	lval* x = lval_copy(v->local < n ? args->cell[v->local+1]
+		: c->vals->cell[v->local-n]);
+	lval_del(v);
+	return x;
+}
+
+//check the lambdas inlined into c are still bound to what they were
+//then, once one has been redefined the body as written is used again
+void lval_guard(lenv* e, lclosure* c) {
+	if (c->outline == NULL) { return; }
+	for (int i = 0; i < c->inlined->count; i++) {
+		lval* g = lenv_lookup(e, c->inlined->cell[i]);
+		if (g && g->type == LVAL_FUN && g->closure == c->callees->cell[i]->closure) {
+			continue;
+		}
+		lval_del(c->body);
+		c->body = c->outline;
+		c->outline = NULL;
+		if (c->chunk) {
+			lchunk_del(c->chunk);
+			c->chunk = NULL;
+		}
+		return;
+	}
+}
+
+//a new lval of size bytes, which isn't shared
+lval* lval_alloc(size_t size) {
+	lval* v = malloc(size);
+	lval_allocs++;
+	lval_bytes += size;
+	v->refs = 0;
+	return v;
+}
+
+//construct a pointer to a new number lval
+lval* lval_num(long x) {
+	lval* v = lval_alloc(sizeof(lval));
+	v->type = LVAL_NUM;
+	v->num = x;
+	return v;
+}
+
+//a big integer of count limbs, all zero
+lval* lval_big(int sign, int count) {
+	lval* v = lval_alloc(sizeof(lval));
+	v->type = LVAL_BIG;
+	v->num = sign;
+	v->limbs_count = count;
+	v->limbs = calloc(count + 1, sizeof(unsigned int));
+	lval_bytes += sizeof(unsigned int) * (count + 1);
+	return v;
+}
+
+//x as a big integer, before normalizing
+lval* lval_big_long(long x) {
+	unsigned long m = x < 0 ? -(unsigned long)x : (unsigned long)x;
+	lval* v = lval_big(x < 0 ? -1 : 1, 2);
+	v->limbs[0] = (unsigned int)m;
+	v->limbs[1] = (unsigned int)(m >> 32);
+	return v;
+}
+
+//read a decimal integer of any size, nine digits at a time
+lval* lval_big_str(char* s) {
+	int sign = 1;
+	if (*s == '-') { sign = -1; s++; }
+	int digits = strlen(s);
+	lval* v = lval_big(sign, digits / 9 + 2);
+
+	int n = 0;
+	while (*s) {
+		unsigned int part = 0;
+		unsigned int scale = 1;
+		for (int k = 0; k < 9 && *s; k++, s++) {
+			part = part * 10 + (*s - '0');
+			scale *= 10;
+		}
+		unsigned long long carry = part;
+		for (int i = 0; i < n; i++) {
+			carry += (unsigned long long)v->limbs[i] * scale;
+			v->limbs[i] = (unsigned int)carry;
+			carry >>= 32;
+		}
+		if (carry) { v->limbs[n++] = (unsigned int)carry; }
+	}
+	v->limbs_count = n;
+	return lval_big_norm(v);
+}
+
+//drop leading zero limbs, and give back a number if the value fits a
+//long, so a big integer is never equal to a number
+lval* lval_big_norm(lval* v) {
+	while (v->limbs_count > 0 && v->limbs[v->limbs_count-1] == 0) {
+		v->limbs_count--;
+	}
+	if (v->limbs_count > 2) { return v; }
+
+	unsigned long m = v->limbs_count > 0 ? v->limbs[0] : 0;
+	if (v->limbs_count == 2) { m |= (unsigned long)v->limbs[1] << 32; }
+	if (m > (unsigned long)LONG_MAX + (v->num < 0)) { return v; }
+
+	long x = m == 0 ? 0 : v->num < 0 ? -(long)(m - 1) - 1 : (long)m;
+	free(v->limbs);
+	v->type = LVAL_NUM;
+	v->num = x;
+	return v;
+}
+
+//construct a pointer to a new floating point lval
+lval* lval_dbl(double x) {
+	lval* v = lval_alloc(sizeof(lval));
+	v->type = LVAL_DBL;
+	v->dbl = x;
+	return v;
+}
+
+//is v a number of any kind
+int lval_number(lval* v) {
+	return v->type == LVAL_NUM || v->type == LVAL_BIG || v->type == LVAL_DBL;
+}
+
+//the nearest double to a number of any kind
+double lval_to_dbl(lval* v) {
+	if (v->type == LVAL_DBL) { return v->dbl; }
+	if (v->type == LVAL_NUM) { return (double)v->num; }
+	double x = 0;
+	for (int i = v->limbs_count-1; i >= 0; i--) { x = x * 4294967296.0 + v->limbs[i]; }
+	return v->num < 0 ? -x : x;
+}
+
+lval* lval_fun(lbuiltin func) {
+	lval* v = lval_alloc(sizeof(lval));
+	v->type = LVAL_FUN;
+	v->fun = func;
+	v->closure = NULL;
+	v->memo = NULL;
+	return v;
+}
+
+//construct a pointer to a new error lval
+lval* lval_err(char* m) {
+	lval* v = lval_alloc(sizeof(lval));
+	v->type = LVAL_ERR;
+	v->err = malloc(strlen(m) + 1);
+	lval_bytes += strlen(m) + 1;
+	strcpy(v->err, m);
+	return v;
+}
+
+//construct a pointer to a new symbol lval
+lval* lval_sym(char* s) {
+	lval* v = lval_alloc(sizeof(lval));
+	v->type = LVAL_SYM;
+	v->sym = malloc(strlen(s) + 1);
+	lval_bytes += strlen(s) + 1;
+	strcpy(v->sym, s);
+	v->slot = -1;
+	v->version = -1;
+	v->local = -1;
+	return v;
+}
+
+//a pointer to a new empty Sexpr lval
+lval* lval_sexpr(void) {
+	lval* v = lval_alloc(sizeof(lval));
+	v->type = LVAL_SEXPR;
+	v->count = 0;
+	v->cell = NULL;
+	return v;
+}
+
+//a pointer to a new empty Qexpr lval
+lval* lval_qexpr(void) {
+	lval* v = lval_alloc(sizeof(lval));
+	v->type = LVAL_QEXPR;
+	v->count = 0;
+	v->cell = NULL;
+	return v;
+}
+
+//literals with a fraction or exponent are doubles, and ones too big
+//for a long are read as big integers
+lval* lval_read_num(mpc_ast_t* t) {
+	if (strpbrk(t->contents, ".eE")) {
+		return lval_dbl(strtod(t->contents, NULL));
+	}
+	errno = 0;
+	long x = strtol(t->contents, NULL, 10);
+	return errno != ERANGE ?
+		lval_num(x) : lval_big_str(t->contents);
+}
+
+//convert a number or symbol, or create the empty list for an
+//expression that lval_read then fills in
+lval* lval_read_node(mpc_ast_t* t) {
+	//if symbol or number return our token converted to that type
+	if (strstr(t->tag, "number")) { return lval_read_num(t); }
+	if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+
+	//if root (>) or sexpr then create empty list
+	lval* x = NULL;
+	if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
+	if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
+	if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+	return x;
+}
+
+//brackets, the regexes anchoring the input and comments aren't values
+int lval_read_skip(mpc_ast_t* t) {
+	if (strcmp(t->contents, "(") == 0) { return 1; }
+	if (strcmp(t->contents, ")") == 0) { return 1; }
+	if (strcmp(t->contents, "{") == 0) { return 1; }
+	if (strcmp(t->contents, "}") == 0) { return 1; }
+	if (strcmp(t->tag, "regex") == 0) { return 1; }
+	if (strstr(t->tag, "comment")) { return 1; }
+	return 0;
+}
+
+//numbers, and Q-expressions holding nothing else, are literals that
+//are shared by every copy of the code they are in. Evaluating one
+//gives the literal itself rather than a copy, builtins that change
+//their arguments thaw them first
+lval* lval_read(mpc_ast_t* t) {
+	lval* x = lval_read_node(t);
+	if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) {
+		x->refs = lval_number(x);
+		return x;
+	}
+
+	//fill each list with any valid expression contained within, with
+	//a frame per list still being read
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, x, NULL, t, 0);
+	while (s.count) {
+		lwork* w = &s.items[s.count-1];
+		if (w->i == w->t->children_num) {
+			lval_share(w->v);
+			s.count--;
+			continue;
+		}
+
+		mpc_ast_t* c = w->t->children[w->i++];
+		if (lval_read_skip(c)) { continue; }
+
+		lval* y = lval_read_node(c);
+		y->refs = lval_number(y);
+		lval_add(w->v, y);
+		if (y->type == LVAL_SEXPR || y->type == LVAL_QEXPR) {
+			lstack_push(&s, y, NULL, c, 0);
+		}
+	}
+	lstack_del(&s);
+	return x;
+}
+
+//share a Q-expression just read if everything in it is shared
+void lval_share(lval* v) {
+	if (v->type != LVAL_QEXPR) { return; }
+	for (int i = 0; i < v->count; i++) {
+		if (v->cell[i]->refs == 0) { return; }
+	}
+	v->refs = 1;
+}
+
+lval* lval_add(lval* v, lval* x) {
+	v->count++;
+	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+	lval_bytes += sizeof(lval*);
+	v->cell[v->count-1] = x;
+	return v;
+}
+
+lval* lval_pop(lval* v, int i) {
+	//find item at i
+	lval* x = v->cell[i];
+
+	//shift memory after the item at i
+	memmove(&v->cell[i], &v->cell[i+1],
+			sizeof(lval*) * (v->count-i-1));
+
+	//decrease the count of items in the list
+	v->count--;
+
+	//reallocate the memory used
+	v->cell = realloc(v->cell, sizeof(lval*) * v->count);
+	return x;
+}
+
+lval* lval_take(lval* v, int i) {
+	lval* x = lval_pop(v, i);
+	lval_del(v);
+	return x;
+}
+
+lval* builtin_add(lenv* e, lval* a) { return builtin_op(e, a, LOP_ADD); }
+lval* builtin_sub(lenv* e, lval* a) { return builtin_op(e, a, LOP_SUB); }
+lval* builtin_mul(lenv* e, lval* a) { return builtin_op(e, a, LOP_MUL); }
+lval* builtin_div(lenv* e, lval* a) { return builtin_op(e, a, LOP_DIV); }
+
+//the operator is fixed by the builtin that was called, so each one
+//gets its own loop over the arguments. They run on longs until an
+//argument is big or a step overflows, and the rest is done on big
+//integers. A double anywhere makes it a double operation
+lval* builtin_op(lenv* e, lval* a, int op) {
+	//ensure all arguments are numbers
+	int dbl = 0;
+	for (int i = 0; i < a->count; i++) {
+		 if (!lval_number(a->cell[i])) {
+			 lval_del(a);
+			 return lval_err("Cannon operate on non-number");
+		 }
+		 dbl |= a->cell[i]->type == LVAL_DBL;
+	}
+	if (dbl) { return ldbl_op(a, op); }
+
+	//if no arguments and sub, then perform unary negation, which only
+	//overflows for LONG_MIN
+	if (op == LOP_SUB && a->count == 1) {
+		lval* x = lval_thaw(lval_take(a, 0));
+		if (x->type == LVAL_NUM && x->num != LONG_MIN) {
+			x->num = -x->num;
+			return x;
+		}
+		if (x->type == LVAL_NUM) {
+			lval_del(x);
+			x = lval_big_long(LONG_MIN);
+		}
+		x->num = -x->num;
+		return lval_big_norm(x);
+	}
+
+	long r = a->cell[0]->num;
+	long t;
+	int i = 1;
+	if (a->cell[0]->type == LVAL_NUM) {
+		switch (op) {
+			case LOP_ADD:
+				for (; i < a->count; i++) {
+					lval* y = a->cell[i];
+					if (y->type != LVAL_NUM || __builtin_add_overflow(r, y->num, &t)) { break; }
+					r = t;
+				}
+				break;
+
+			case LOP_SUB:
+				for (; i < a->count; i++) {
+					lval* y = a->cell[i];
+					if (y->type != LVAL_NUM || __builtin_sub_overflow(r, y->num, &t)) { break; }
+					r = t;
+				}
+				break;
+
+			case LOP_MUL:
+				for (; i < a->count; i++) {
+					lval* y = a->cell[i];
+					if (y->type != LVAL_NUM || __builtin_mul_overflow(r, y->num, &t)) { break; }
+					r = t;
+				}
+				break;
+
+			case LOP_DIV:
+				for (; i < a->count; i++) {
+					lval* y = a->cell[i];
+					if (y->type != LVAL_NUM || (y->num == -1 && r == LONG_MIN)) { break; }
+					if (y->num == 0) {
+						lval_del(a);
+						return lval_err("Division By Zero!");
+					}
+					r /= y->num;
+				}
+				break;
+		}
+
+		//reuse the first argument for the result
+		if (i == a->count) {
+			lval* x = lval_thaw(lval_take(a, 0));
+			x->num = r;
+			return x;
+		}
+	}
+
+	lval* x = a->cell[0]->type == LVAL_NUM ? lval_num(r) : lval_copy(a->cell[0]);
+	for (; i < a->count && x->type != LVAL_ERR; i++) {
+		x = lbig_op(op, x, a->cell[i]);
+	}
+	lval_del(a);
+	return x;
+}
+
+//arithmetic with at least one double. The integers are converted once
+//up front, so the loops run on doubles without looking at types
+lval* ldbl_op(lval* a, int op) {
+	for (int i = 0; i < a->count; i++) {
+		lval* x = a->cell[i];
+		if (x->type == LVAL_DBL) { continue; }
+		x = a->cell[i] = lval_thaw(x);
+		double d = lval_to_dbl(x);
+		if (x->type == LVAL_BIG) { free(x->limbs); }
+		x->type = LVAL_DBL;
+		x->dbl = d;
+	}
+
+	double r = a->cell[0]->dbl;
+	switch (op) {
+		case LOP_ADD:
+			for (int i = 1; i < a->count; i++) { r += a->cell[i]->dbl; }
+			break;
+
+		case LOP_SUB:
+			if (a->count == 1) { r = -r; }
+			for (int i = 1; i < a->count; i++) { r -= a->cell[i]->dbl; }
+			break;
+
+		case LOP_MUL:
+			for (int i = 1; i < a->count; i++) { r *= a->cell[i]->dbl; }
+			break;
+
+		case LOP_DIV:
+			for (int i = 1; i < a->count; i++) {
+				if (a->cell[i]->dbl == 0) {
+					lval_del(a);
+					return lval_err("Division By Zero!");
+				}
+				r /= a->cell[i]->dbl;
+			}
+			break;
+	}
+
+	//reuse the first argument for the result
+	lval* x = lval_thaw(lval_take(a, 0));
+	x->dbl = r;
+	return x;
+}
+
+//x op y on numbers or big integers, consuming x
+lval* lbig_op(int op, lval* x, lval* y) {
+	if (op == LOP_DIV && y->type == LVAL_NUM && y->num == 0) {
+		lval_del(x);
+		return lval_err("Division By Zero!");
+	}
+	lval* a = x->type == LVAL_BIG ? x : lval_big_long(x->num);
+	lval* b = y->type == LVAL_BIG ? y : lval_big_long(y->num);
+	int an = a->limbs_count;
+	int bn = b->limbs_count;
+	lval* r;
+
+	switch (op) {
+		case LOP_ADD:
+		case LOP_SUB: {
+			//same signs add the magnitudes, otherwise the smaller one is
+			//taken from the larger, which gives the sign
+			int bs = op == LOP_SUB ? -b->num : b->num;
+			if (a->num == bs) {
+				r = lval_big(bs, (an > bn ? an : bn) + 1);
+				lmag_add(a->limbs, an, b->limbs, bn, r->limbs);
+			} else if (lmag_cmp(a->limbs, an, b->limbs, bn) >= 0) {
+				r = lval_big(a->num, an);
+				memcpy(r->limbs, a->limbs, sizeof(unsigned int) * an);
+				lmag_sub(r->limbs, an, b->limbs, bn);
+			} else {
+				r = lval_big(bs, bn);
+				memcpy(r->limbs, b->limbs, sizeof(unsigned int) * bn);
+				lmag_sub(r->limbs, bn, a->limbs, an);
+			}
+			break;
+		}
+
+		case LOP_MUL:
+			r = lval_big(a->num * b->num, an + bn);
+			lmag_mul(a->limbs, an, b->limbs, bn, r->limbs);
+			break;
+
+		//rounds towards zero like division of longs
+		default:
+			r = lval_big(a->num * b->num, an);
+			lmag_div(a->limbs, an, b->limbs, bn, r->limbs);
+			break;
+	}
+
+	if (a != x) { lval_del(a); }
+	if (b != y) { lval_del(b); }
+	lval_del(x);
+	return lval_big_norm(r);
+}
+
+//compare numbers or big integers, -1, 0 or 1 as x is less, equal or
+//greater
+int lbig_cmp(lval* x, lval* y) {
+	if (x->type == LVAL_NUM && y->type == LVAL_NUM) {
+		return (x->num > y->num) - (x->num < y->num);
+	}
+	//a big integer is further from zero than any number
+	if (x->type == LVAL_NUM) { return -y->num; }
+	if (y->type == LVAL_NUM) { return x->num; }
+	if (x->num != y->num) { return x->num; }
+	return x->num * lmag_cmp(x->limbs, x->limbs_count, y->limbs, y->limbs_count);
+}
+
+//decimal digits of a big integer, split off nine at a time
+char* lbig_str(lval* v) {
+	int n = v->limbs_count;
+	unsigned int* t = malloc(sizeof(unsigned int) * (n + 1));
+	memcpy(t, v->limbs, sizeof(unsigned int) * n);
+	unsigned int* parts = malloc(sizeof(unsigned int) * (n * 32 / 29 + 2));
+	int k = 0;
+	while (n > 0) {
+		parts[k++] = lmag_div_small(t, n, 1000000000);
+		while (n > 0 && t[n-1] == 0) { n--; }
+	}
+
+	char* s = malloc(k * 9 + 3);
+	int len = sprintf(s, "%s%u", v->num < 0 ? "-" : "", k ? parts[k-1] : 0);
+	for (int i = k-2; i >= 0; i--) { len += sprintf(s + len, "%09u", parts[i]); }
+	free(t);
+	free(parts);
+	return s;
+}
+
+//the fewest significant digits from 15 to 17 that read back as x,
+//with a .0 added if that would look like an integer
+void ldbl_str(char* s, double x) {
+	for (int p = 15; p <= 17; p++) {
+		sprintf(s, "%.*g", p, x);
+		if (strtod(s, NULL) == x) { break; }
+	}
+	if (strspn(s, "-0123456789") == strlen(s)) { strcat(s, ".0"); }
+}
+
+//compare magnitudes, which may have leading zero limbs
+int lmag_cmp(const unsigned int* a, int an, const unsigned int* b, int bn) {
+	while (an > 0 && a[an-1] == 0) { an--; }
+	while (bn > 0 && b[bn-1] == 0) { bn--; }
+	if (an != bn) { return an > bn ? 1 : -1; }
+	for (int i = an-1; i >= 0; i--) {
+		if (a[i] != b[i]) { return a[i] > b[i] ? 1 : -1; }
+	}
+	return 0;
+}
+
+//r = a + b, r has room for one more limb than the longer of them.
+//Returns how many limbs r has
+int lmag_add(const unsigned int* a, int an, const unsigned int* b, int bn, unsigned int* r) {
+	int n = an > bn ? an : bn;
+	unsigned long long carry = 0;
+	for (int i = 0; i < n; i++) {
+		carry += (unsigned long long)(i < an ? a[i] : 0) + (i < bn ? b[i] : 0);
+		r[i] = (unsigned int)carry;
+		carry >>= 32;
+	}
+	r[n] = (unsigned int)carry;
+	return n + 1;
+}
+
+//r -= b, where r is at least b
+void lmag_sub(unsigned int* r, int rn, const unsigned int* b, int bn) {
+	long long borrow = 0;
+	for (int i = 0; i < rn && (i < bn || borrow); i++) {
+		long long d = (long long)r[i] - (i < bn ? b[i] : 0) - borrow;
+		borrow = d < 0;
+		r[i] = (unsigned int)(d + (borrow << 32));
+	}
+}
+
+//r += b shifted up by off limbs. Limbs of b past the end of r are zero
+void lmag_add_at(unsigned int* r, int rn, const unsigned int* b, int bn, int off) {
+	unsigned long long carry = 0;
+	for (int i = off; i < rn && (i - off < bn || carry); i++) {
+		carry += (unsigned long long)r[i] + (i - off < bn ? b[i-off] : 0);
+		r[i] = (unsigned int)carry;
+		carry >>= 32;
+	}
+}
+
+//products of magnitudes at least this many limbs long use karatsuba
+#define KARATSUBA 32
+
+//r = a * b, r has room for an + bn limbs. Long magnitudes are split in
+//halves so that three half size products do the work of four
+void lmag_mul(const unsigned int* a, int an, const unsigned int* b, int bn, unsigned int* r) {
+	if (an < bn) {
+		const unsigned int* t = a; a = b; b = t;
+		int tn = an; an = bn; bn = tn;
+	}
+	memset(r, 0, sizeof(unsigned int) * (an + bn));
+
+	if (bn < KARATSUBA) {
+		for (int i = 0; i < bn; i++) {
+			unsigned long long carry = 0;
+			for (int j = 0; j < an; j++) {
+				carry += (unsigned long long)a[j] * b[i] + r[i+j];
+				r[i+j] = (unsigned int)carry;
+				carry >>= 32;
+			}
+			r[i+an] = (unsigned int)carry;
+		}
+		return;
+	}
+
+	//b is too short to split, a is multiplied by it a half at a time
+	int m = an / 2;
+	if (bn <= m) {
+		unsigned int* t = malloc(sizeof(unsigned int) * (an - m + bn));
+		lmag_mul(a, m, b, bn, r);
+		lmag_mul(a + m, an - m, b, bn, t);
+		lmag_add_at(r, an + bn, t, an - m + bn, m);
+		free(t);
+		return;
+	}
+
+	//with a = a1 B^m + a0 and b = b1 B^m + b0, a b is
+	//z2 B^2m + (z1 - z2 - z0) B^m + z0 where z1 = (a1 + a0)(b1 + b0)
+	int an1 = an - m;
+	int bn1 = bn - m;
+	unsigned int* z0 = malloc(sizeof(unsigned int) * 2 * m);
+	unsigned int* z2 = malloc(sizeof(unsigned int) * (an1 + bn1));
+	unsigned int* sa = malloc(sizeof(unsigned int) * (an1 + 1));
+	unsigned int* sb = malloc(sizeof(unsigned int) * ((bn1 > m ? bn1 : m) + 1));
+	lmag_mul(a, m, b, m, z0);
+	lmag_mul(a + m, an1, b + m, bn1, z2);
+	int san = lmag_add(a, m, a + m, an1, sa);
+	int sbn = lmag_add(b, m, b + m, bn1, sb);
+	unsigned int* z1 = malloc(sizeof(unsigned int) * (san + sbn));
+	lmag_mul(sa, san, sb, sbn, z1);
+	lmag_sub(z1, san + sbn, z0, 2 * m);
+	lmag_sub(z1, san + sbn, z2, an1 + bn1);
+
+	memcpy(r, z0, sizeof(unsigned int) * 2 * m);
+	lmag_add_at(r, an + bn, z2, an1 + bn1, 2 * m);
+	lmag_add_at(r, an + bn, z1, san + sbn, m);
+	free(z0);
+	free(z1);
+	free(z2);
+	free(sa);
+	free(sb);
+}
+
+//q = a / b rounded down, q has room for an limbs and b isn't zero.
+//One limb divisors divide directly, longer ones a bit at a time
+void lmag_div(const unsigned int* a, int an, const unsigned int* b, int bn, unsigned int* q) {
+	while (bn > 0 && b[bn-1] == 0) { bn--; }
+	memcpy(q, a, sizeof(unsigned int) * an);
+	if (bn == 1) {
+		lmag_div_small(q, an, b[0]);
+		return;
+	}
+
+	memset(q, 0, sizeof(unsigned int) * an);
+	unsigned int* rem = calloc(bn + 1, sizeof(unsigned int));
+	for (long bit = (long)an * 32 - 1; bit >= 0; bit--) {
+		for (int i = bn; i > 0; i--) { rem[i] = (rem[i] << 1) | (rem[i-1] >> 31); }
+		rem[0] = (rem[0] << 1) | ((a[bit / 32] >> (bit % 32)) & 1);
+		if (lmag_cmp(rem, bn + 1, b, bn) >= 0) {
+			lmag_sub(rem, bn + 1, b, bn);
+			q[bit / 32] |= 1u << (bit % 32);
+		}
+	}
+	free(rem);
+}
+
+//a /= d in place, returning the remainder
+unsigned int lmag_div_small(unsigned int* a, int an, unsigned int d) {
+	unsigned long long rem = 0;
+	for (int i = an-1; i >= 0; i--) {
+		rem = (rem << 32) | a[i];
+		a[i] = (unsigned int)(rem / d);
+		rem %= d;
+	}
+	return (unsigned int)rem;
+}
+
+lval* builtin_gt(lenv* e, lval* a) { return builtin_ord(e, a, LOP_GT); }
+lval* builtin_lt(lenv* e, lval* a) { return builtin_ord(e, a, LOP_LT); }
+lval* builtin_ge(lenv* e, lval* a) { return builtin_ord(e, a, LOP_GE); }
+lval* builtin_le(lenv* e, lval* a) { return builtin_ord(e, a, LOP_LE); }
+
+lval* builtin_ord(lenv* e, lval* a, int op) {
+	LASSERT(a, a->count == 2,
+		"Function passed incorrect number of arguments for ordering!");
+	LASSERT(a, lval_number(a->cell[0]) && lval_number(a->cell[1]),
+		"Cannot order non-number");
+
+	//with a double on either side both are compared as doubles
+	int r = 0;
+	if (a->cell[0]->type == LVAL_DBL || a->cell[1]->type == LVAL_DBL) {
+		double x = lval_to_dbl(a->cell[0]);
+		double y = lval_to_dbl(a->cell[1]);
+		switch (op) {
+			case LOP_GT: r = x >  y; break;
+			case LOP_LT: r = x <  y; break;
+			case LOP_GE: r = x >= y; break;
+			case LOP_LE: r = x <= y; break;
+		}
+		lval_del(a);
+		return lval_num(r);
+	}
+
+	int c = lbig_cmp(a->cell[0], a->cell[1]);
+	switch (op) {
+		case LOP_GT: r = c >  0; break;
+		case LOP_LT: r = c <  0; break;
+		case LOP_GE: r = c >= 0; break;
+		case LOP_LE: r = c <= 0; break;
+	}
+	lval_del(a);
+	return lval_num(r);
+}
+
+lval* builtin_eq(lenv* e, lval* a) { return builtin_cmp(e, a, LOP_EQ); }
+lval* builtin_ne(lenv* e, lval* a) { return builtin_cmp(e, a, LOP_NE); }
+
+lval* builtin_cmp(lenv* e, lval* a, int op) {
+	LASSERT(a, a->count == 2,
+		"Function passed incorrect number of arguments for comparison!");
+
+	//numbers of different kinds are equal if they have the same value
+	lval* x = a->cell[0];
+	lval* y = a->cell[1];
+	int r = (x->type == LVAL_DBL) != (y->type == LVAL_DBL)
+		&& lval_number(x) && lval_number(y) ?
+		lval_to_dbl(x) == lval_to_dbl(y) : lval_eq(x, y);
+	if (op == LOP_NE) { r = !r; }
+	lval_del(a);
+	return lval_num(r);
+}
+
+//if cond then [else], only the branch taken is evaluated. Branches
+//given as Q-expressions are code, as for eval
+lval* builtin_if(lenv* e, lval* a) {
+	LASSERT(a, a->count == 2 || a->count == 3,
+		"Function 'if' passed incorrect number of arguments!");
+
+	lval* c = lval_eval(e, lval_pop(a, 0));
+	if (c->type == LVAL_ERR) {
+		lval_del(a);
+		return c;
+	}
+	if (c->type != LVAL_NUM) {
+		lval_del(c);
+		lval_del(a);
+		return lval_err("Function 'if' passed incorrect type!");
+	}
+
+	int i = c->num ? 0 : 1;
+	lval_del(c);
+	if (i == a->count) {
+		lval_del(a);
+		return lval_sexpr();
+	}
+
+	lval* x = lval_thaw(lval_take(a, i));
+	if (x->type == LVAL_QEXPR) { x->type = LVAL_SEXPR; }
+	return x;
+}
+
+lval* builtin_and(lenv* e, lval* a) { return builtin_logic(e, a, LOP_AND); }
+lval* builtin_or(lenv* e, lval* a) { return builtin_logic(e, a, LOP_OR); }
+
+//evaluate arguments left to right until one decides the result, and
+//stops at the first false one, or at the first true one
+lval* builtin_logic(lenv* e, lval* a, int op) {
+	int r = op == LOP_AND;
+	while (a->count > 0) {
+		lval* x = lval_eval(e, lval_pop(a, 0));
+		if (x->type == LVAL_ERR) {
+			lval_del(a);
+			return x;
+		}
+		if (x->type != LVAL_NUM) {
+			lval_del(x);
+			lval_del(a);
+			return lval_err(op == LOP_AND ? "Function 'and' passed incorrect type!"
+				: "Function 'or' passed incorrect type!");
+		}
+
+		int t = x->num != 0;
+		lval_del(x);
+		if (t != r) {
+			r = t;
+			break;
+		}
+	}
+	lval_del(a);
+	return lval_num(r);
+}
+
+//while cond body, dotimes {i} n body and foreach {x} list body. The
+//condition and body are compiled to bytecode once and run from there,
+//so they are never copied or read again however often they run
+lval* builtin_while(lenv* e, lval* a) {
+	LASSERT(a, a->count == 2,
+		"Function 'while' passed incorrect number of arguments!");
+
+	lchunk* cond = lval_compile_code(e, a->cell[0]);
+	lchunk* body = lval_compile_code(e, a->cell[1]);
+	lval* x = lval_while(e, cond, body);
+	lchunk_del(cond);
+	lchunk_del(body);
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_dotimes(lenv* e, lval* a) {
+	LASSERT(a, a->count == 3,
+		"Function 'dotimes' passed incorrect number of arguments!");
+
+	a->cell[0] = lval_eval(e, a->cell[0]);
+	if (a->cell[0]->type == LVAL_ERR) { return lval_take(a, 0); }
+	LASSERT(a, a->cell[0]->type == LVAL_QEXPR && a->cell[0]->count == 1
+		&& a->cell[0]->cell[0]->type == LVAL_SYM,
+		"Function 'dotimes' passed incorrect type!");
+
+	lchunk* body = lval_compile_code(e, a->cell[2]);
+	lval* x = lval_dotimes(e, a->cell[0]->cell[0],
+		lval_eval(e, lval_pop(a, 1)), body);
+	lchunk_del(body);
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_foreach(lenv* e, lval* a) {
+	LASSERT(a, a->count == 3,
+		"Function 'foreach' passed incorrect number of arguments!");
+
+	a->cell[0] = lval_eval(e, a->cell[0]);
+	if (a->cell[0]->type == LVAL_ERR) { return lval_take(a, 0); }
+	LASSERT(a, a->cell[0]->type == LVAL_QEXPR && a->cell[0]->count == 1
+		&& a->cell[0]->cell[0]->type == LVAL_SYM,
+		"Function 'foreach' passed incorrect type!");
+
+	lchunk* body = lval_compile_code(e, a->cell[2]);
+	lval* x = lval_foreach(e, a->cell[0]->cell[0],
+		lval_eval(e, lval_pop(a, 1)), body);
+	lchunk_del(body);
+	lval_del(a);
+	return x;
+}
+
+//the loops themselves, shared with the vm. They give () or the first
+//error, and take ownership of n and l
+lval* lval_while(lenv* e, lchunk* cond, lchunk* body) {
+	while (1) {
+		vslot c = lchunk_value(e, cond);
+		if (c.v && c.v->type == LVAL_ERR) { return c.v; }
+		if (c.v) {
+			lval_del(c.v);
+			return lval_err("Function 'while' passed incorrect type!");
+		}
+		if (c.num == 0) { return lval_sexpr(); }
+
+		lval* x = lval_loop(e, body);
+		if (x) { return x; }
+	}
+}
+
+lval* lval_dotimes(lenv* e, lval* k, lval* n, lchunk* body) {
+	if (n->type == LVAL_ERR) { return n; }
+	if (n->type != LVAL_NUM) {
+		lval_del(n);
+		return lval_err("Function 'dotimes' passed incorrect type!");
+	}
+
+	for (long i = 0; i < n->num; i++) {
+		lenv_put_num(e, k, i);
+		lval* x = lval_loop(e, body);
+		if (x) {
+			lval_del(n);
+			return x;
+		}
+	}
+	lval_del(n);
+	return lval_sexpr();
+}
+
+lval* lval_foreach(lenv* e, lval* k, lval* l, lchunk* body) {
+	if (l->type == LVAL_ERR) { return l; }
+	if (l->type != LVAL_QEXPR) {
+		lval_del(l);
+		return lval_err("Function 'foreach' passed incorrect type!");
+	}
+
+	for (int i = 0; i < l->count; i++) {
+		if (l->cell[i]->type == LVAL_NUM) {
+			lenv_put_num(e, k, l->cell[i]->num);
+		} else {
+			lenv_put(e, k, l->cell[i]);
+		}
+		lval* x = lval_loop(e, body);
+		if (x) {
+			lval_del(l);
+			return x;
+		}
+	}
+	lval_del(l);
+	return lval_sexpr();
+}
+
+//run a loop body once, returning the error that ends the loop if any
+lval* lval_loop(lenv* e, lchunk* body) {
+	loop_iters++;
+	vslot x = lchunk_value(e, body);
+	if (x.v == NULL) { return NULL; }
+	if (x.v->type == LVAL_ERR) { return x.v; }
+	lval_del(x.v);
+	return NULL;
+}
+
+//\ {args} {body} makes a lambda. It is a special form so that the
+//body is converted once here rather than evaluated, both arguments
+//are still evaluated like any others
+lval* builtin_lambda(lenv* e, lval* a) {
+	LASSERT(a, a->count == 2,
+		"Function '\\' passed incorrect number of arguments!");
+
+	for (int i = 0; i < a->count; i++) {
+		a->cell[i] = lval_eval(e, a->cell[i]);
+	}
+	for (int i = 0; i < a->count; i++) {
+		if (a->cell[i]->type == LVAL_ERR) { return lval_take(a, i); }
+	}
+	LASSERT(a, a->cell[0]->type == LVAL_QEXPR && a->cell[1]->type == LVAL_QEXPR,
+		"Function '\\' passed incorrect type!");
+	for (int i = 0; i < a->cell[0]->count; i++) {
+		LASSERT(a, a->cell[0]->cell[i]->type == LVAL_SYM,
+			"Function '\\' cannot define non-symbol!");
+	}
+	LASSERT(a, lval_distinct(a->cell[0]),
+		"Function '\\' cannot define a name twice!");
+
+	lval* formals = lval_pop(a, 0);
+	return lval_lambda(e, formals, lval_take(a, 0));
+}
+
+lval* lval_lambda(lenv* e, lval* formals, lval* body) {
+	lval* f = lval_closure(formals, lval_qexpr(), lval_qexpr(), body);
+	lclosure* c = f->closure;
+
+	//the body refers to a lazy formal ~x as x
+	for (int i = 0; i < formals->count; i++) {
+		char* s = formals->cell[i]->sym;
+		if (s[0] != '~' || s[1] == '\0') { continue; }
+		if (c->lazy == NULL) { c->lazy = calloc(formals->count, 1); }
+		c->lazy[i] = 1;
+		memmove(s, s + 1, strlen(s));
+	}
+	body = c->body = lval_expand_code(e, f, body);
+	lval_convert(e, f, body);
+	if (!use_inline || lval_deep(body)) { return f; }
+
+	//inline into a copy of the body, which is only used if nothing
+	//left in it could redefine an inlined lambda during a call
+	lval* x = lval_inline(e, f, lval_copy(body));
+	lval_convert(e, f, x);
+	if (c->inlined->count == 0 || lval_opaque(e, f, x)) {
+		lval_del(x);
+		lval_del(c->inlined);
+		lval_del(c->callees);
+		c->inlined = lval_qexpr();
+		c->callees = lval_qexpr();
+		return f;
+	}
+	if (dump_inline) {
+		printf("inline: ");
+		lval_print(body);
+		printf(" -> ");
+		lval_println(x);
+	}
+	c->outline = body;
+	c->body = x;
+	return f;
+}
+
+//are the formals all different names, a lazy ~x being named x
+int lval_distinct(lval* formals) {
+	for (int i = 0; i < formals->count; i++) {
+		char* x = formals->cell[i]->sym;
+		if (x[0] == '~' && x[1] != '\0') { x++; }
+		for (int j = 0; j < i; j++) {
+			char* y = formals->cell[j]->sym;
+			if (y[0] == '~' && y[1] != '\0') { y++; }
+			if (strcmp(x, y) == 0) { return 0; }
+		}
+	}
+	return 1;
+}
+
+//a lambda with a new closure record, which takes ownership of all
+//four lists
+lval* lval_closure(lval* formals, lval* names, lval* vals, lval* body) {
+	lclosure* c = malloc(sizeof(lclosure));
+	c->refs = 1;
+	c->formals = formals;
+	c->names = names;
+	c->vals = vals;
+	c->body = body;
+	c->chunk = NULL;
+	c->lazy = NULL;
+	c->lets = lval_qexpr();
+	c->let_next = -1;
+	c->outline = NULL;
+	c->inlined = lval_qexpr();
+	c->callees = lval_qexpr();
+
+	lval* f = lval_fun(NULL);
+	f->closure = c;
+	return f;
+}
+
+//convert code v in the body of f when f is made. Captured values
+//come after the let slots, so if any were captured before the last
+//let was found the code is closed again with the slots kept
+void lval_convert(lenv* e, lval* f, lval* v) {
+	lclosure* c = f->closure;
+	int lets = c->lets->count;
+	c->let_next = 0;
+	lval_close(e, f, v, NULL);
+	if (c->lets->count != lets && c->names->count) {
+		c->let_next = 0;
+		lval_close(e, f, v, NULL);
+	}
+	c->let_next = -1;
+}
+
+//flat closure conversion of code v in the body of f. A symbol naming
+//an argument of f or a let around it gets its frame slot, one naming
+//a variable of the lambda running now is captured by value and gets a
+//slot after those, anything else stays global. Lambdas nested in the
+//body are converted when they are created, but what they use from
+//here is captured now so it is in f's frame by then
+void lval_close(lenv* e, lval* f, lval* v, lscope* scope) {
+	lclosure* c = f->closure;
+
+	//the scopes of nested lambdas and lets are made as they are
+	//reached and freed once everything is closed
+	lscope** scopes = NULL;
+	int scopes_count = 0;
+
+	//code is closed in the order it is written, each frame holding
+	//the scope it is in
+	lstack s;
+	lstack_init(&s);
+	lval_close_push(&s, v, scope);
+	while (s.count) {
+		lwork w = s.items[--s.count];
+		lval* x = w.v;
+		if (x->type == LVAL_SYM) {
+			lval_close_sym(e, f, x, w.scope);
+			continue;
+		}
+		if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { continue; }
+
+		//special forms are recognised by their global binding, as when
+		//compiling
+		int k = x->count > 0 && x->cell[0]->type == LVAL_SYM
+			? lenv_slot(e, x->cell[0]) : -1;
+		lbuiltin g = k != -1 && e->vals[k]->type == LVAL_FUN ? e->vals[k]->fun : NULL;
+		if (g == builtin_lambda && x->count == 3 && x->cell[1]->type == LVAL_QEXPR
+			&& x->cell[2]->type == LVAL_QEXPR) {
+			lscope* t = lscope_new(&scopes, &scopes_count, x->cell[1], NULL, w.scope);
+			lval_close_push(&s, x->cell[2], t);
+			continue;
+		}
+
+		//the names of a let get consecutive slots before anything in it
+		//is closed. Lets in nested lambdas are theirs, and ones closed
+		//after f was made run as lambdas of their own. Each value sees
+		//the names bound before it, and the body sees all of them
+		if (g == builtin_let && lval_let_form(x)) {
+			int nested = 0;
+			for (lscope* t = w.scope; t; t = t->up) { nested |= t->formals != NULL; }
+			lval* b = x->cell[1];
+			for (int i = 0; i < b->count; i += 2) {
+				b->cell[i]->local = -1;
+				if (nested || c->let_next == -1) { continue; }
+				b->cell[i]->local = c->formals->count + c->let_next;
+				if (c->let_next == c->lets->count) { lval_add(c->lets, lval_sym(b->cell[i]->sym)); }
+				c->let_next++;
+			}
+
+			lscope* t = w.scope;
+			for (int i = 0; i < b->count; i += 2) {
+				t = lscope_new(&scopes, &scopes_count, NULL, b->cell[i], t);
+			}
+			lval_close_push(&s, x->cell[2], t);
+			for (int i = b->count - 1; i > 0; i -= 2) {
+				t = t->up;
+				if (b->cell[i]->type != LVAL_QEXPR) { lval_close_push(&s, b->cell[i], t); }
+			}
+			continue;
+		}
+
+		//other Q-expressions are data unless they are code for g
+		for (int i = x->count - 1; i >= 0; i--) {
+			if (x->cell[i]->type != LVAL_QEXPR || lval_code_arg(g, i)) {
+				lval_close_push(&s, x->cell[i], w.scope);
+			}
+		}
+	}
+	lstack_del(&s);
+
+	for (int i = 0; i < scopes_count; i++) { free(scopes[i]); }
+	free(scopes);
+}
+
+//close symbol v in the body of f
+void lval_close_sym(lenv* e, lval* f, lval* v, lscope* scope) {
+	lclosure* c = f->closure;
+	int nested = 0;
+	for (lscope* s = scope; s; s = s->up) {
+		if (s->sym && strcmp(s->sym->sym, v->sym) == 0) {
+			if (!nested) { v->local = s->sym->local; }
+			return;
+		}
+		for (int i = 0; s->formals && i < s->formals->count; i++) {
+			if (strcmp(s->formals->cell[i]->sym, v->sym) == 0) { return; }
+		}
+		if (s->formals) { nested = 1; }
+	}
+
+	//code closed while f runs, and lambdas it makes, see the lets
+	//whose bodies are running
+	int i = f == e->fn ? lval_let_slot(e, v->sym) : -1;
+	if (i == -1) { i = lval_local(f, v->sym); }
+	int k = -1;
+	if (i == -1 && e->fn && f != e->fn) {
+		k = lval_let_slot(e, v->sym);
+		if (k == -1) { k = lval_local(e->fn, v->sym); }
+	}
+	if (k != -1) {
+		//a lazy argument is forced when captured
+		if (e->frame[k]->type == LVAL_THUNK) { lval_force(e, e->frame[k]); }
+		lval_add(c->names, lval_sym(v->sym));
+		lval_add(c->vals, lval_copy(e->frame[k]));
+		i = lval_local(f, v->sym);
+	}
+	if (!nested) { v->local = i; }
+}
+
+//push v for lval_close to close in scope
+void lval_close_push(lstack* s, lval* v, lscope* scope) {
+	lstack_push(s, v, NULL, NULL, 0);
+	s->items[s->count-1].scope = scope;
+}
+
+//a scope for lval_close, added to the ones it frees when done
+lscope* lscope_new(lscope*** scopes, int* count, lval* formals, lval* sym, lscope* up) {
+	lscope* t = malloc(sizeof(lscope));
+	t->formals = formals;
+	t->sym = sym;
+	t->up = up;
+	(*count)++;
+	*scopes = realloc(*scopes, sizeof(lscope*) * *count);
+	(*scopes)[*count-1] = t;
+	return t;
+}
+
+//is argument i of a call to f code that f evaluates: the branches of
+//if, the condition and body of while, loop bodies, what eval runs and
+//the body of let. The values of a let are code too, but its names are
+//not calls, so the list of them is left to the let itself
+int lval_code_arg(lbuiltin f, int i) {
+	if (f == builtin_if) { return i >= 2; }
+	if (f == builtin_let) { return i == 2; }
+	if (f == builtin_while) { return i >= 1; }
+	if (f == builtin_dotimes || f == builtin_foreach) { return i == 3; }
+	if (f == builtin_eval) { return i == 1; }
+	return 0;
+}
+
+//frame slot of the argument or captured variable of f named s, -1 if
+//there is none
+int lval_local(lval* f, char* s) {
+	lclosure* c = f->closure;
+	for (int i = 0; i < c->formals->count; i++) {
+		if (strcmp(c->formals->cell[i]->sym, s) == 0) { return i; }
+	}
+	for (int i = 0; i < c->names->count; i++) {
+		if (strcmp(c->names->cell[i]->sym, s) == 0) {
+			return c->formals->count + c->lets->count + i;
+		}
+	}
+	return -1;
+}
+
+//frame slot of the innermost let binding s whose value is set in the
+//lambda running now, -1 if there is none. Slots are only set while
+//the let runs, and a let's names come before those of lets inside it
+int lval_let_slot(lenv* e, char* s) {
+	if (e->fn == NULL) { return -1; }
+	lclosure* c = e->fn->closure;
+	int n = c->formals->count;
+	for (int i = c->lets->count-1; i >= 0; i--) {
+		if (e->frame[n+i] && strcmp(c->lets->cell[i]->sym, s) == 0) { return n+i; }
+	}
+	return -1;
+}
+
+//is v a let {name value ...} {body} whose names can be given slots
+int lval_let_form(lval* v) {
+	if (v->count != 3 || v->cell[1]->type != LVAL_QEXPR
+		|| v->cell[2]->type != LVAL_QEXPR || v->cell[1]->count % 2) { return 0; }
+	for (int i = 0; i < v->cell[1]->count; i += 2) {
+		if (v->cell[1]->cell[i]->type != LVAL_SYM) { return 0; }
+	}
+	return 1;
+}
+
+//let {x 1 y (+ x 1)} {body} binds each name to its value in turn, so
+//later values see earlier names, then evaluates the body with them.
+//In a lambda the names were given frame slots when it was made, which
+//are set here and emptied once the body is done, so nothing is
+//allocated or looked up by name. Anywhere else the let is run as the
+//body of a lambda made for it
+lval* builtin_let(lenv* e, lval* a) {
+	LASSERT(a, a->count == 2,
+		"Function 'let' passed incorrect number of arguments!");
+	lval* v = lval_sexpr();
+	lval_add(v, lval_sym("let"));
+	lval_add(v, lval_pop(a, 0));
+	lval_add(v, lval_take(a, 0));
+	if (!lval_let_form(v)) {
+		lval_del(v);
+		return lval_err("Function 'let' passed incorrect type!");
+	}
+
+	lval* b = v->cell[1];
+	int first = b->count ? b->cell[0]->local : -1;
+	if (b->count && (first == -1 || first + b->count/2 > e->frame_count)) {
+		v->type = LVAL_QEXPR;
+		lval* f = lval_lambda(e, lval_qexpr(), v);
+		lval* x = lval_call_args(e, f, NULL, 0);
+		lval_del(f);
+		return x;
+	}
+
+	lval* x = NULL;
+	for (int i = 0; i < b->count && x == NULL; i += 2) {
+		lval* y = lval_eval(e, b->cell[i+1]);
+		b->cell[i+1] = lval_sexpr();
+		if (y->type == LVAL_ERR) {
+			x = y;
+		} else {
+			e->frame[first + i/2] = y;
+		}
+	}
+	if (x == NULL) {
+		lval* body = lval_thaw(v->cell[2]);
+		body->type = LVAL_SEXPR;
+		v->cell[2] = lval_sexpr();
+		x = lval_eval(e, body);
+	}
+	for (int i = 0; i < b->count/2; i++) {
+		if (e->frame[first+i]) { lval_del(e->frame[first+i]); }
+		e->frame[first+i] = NULL;
+	}
+	lval_del(v);
+	return x;
+}
+
+//call a lambda on the arguments in a
+lval* lval_call_fn(lenv* e, lval* f, lval* a) {
+	lval* x = lval_call_args(e, f, a->cell, a->count);
+	a->count = 0;
+	lval_del(a);
+	return x;
+}
+
+//frames up to this size live on the C stack of the call
+#define LFRAME_LOCAL 8
+
+//call a lambda, consuming the count values in args. A call its body
+//ends in is made here once the body's frame is gone, and so on, so a
+//chain of tail calls runs in constant C stack
+lval* lval_call_args(lenv* e, lval* f, lval** args, int count) {
+	lval* x = lval_call_frame(e, f, args, count);
+	lval* g = NULL;
+	while (x == NULL) {
+		lval* t = e->tail;
+		e->tail = NULL;
+		if (g) { lval_del(g); }
+		g = lval_pop(t, 0);
+		x = lval_call_frame(e, g, t->cell, t->count);
+		t->count = 0;
+		lval_del(t);
+	}
+	if (g) { lval_del(g); }
+	return x;
+}
+
+//run the body of lambda f on the count values in args, which move
+//into a frame array together with the captured values. The body
+//indexes it, so no environment is built or copied. Lambdas created by
+//the body copy what they capture, so the frame never outlives the
+//call. NULL is returned when the body ended in a tail call
+lval* lval_call_frame(lenv* e, lval* f, lval** args, int count) {
+	lclosure* c = f->closure;
+	int n = c->formals->count;
+	if (count != n) {
+		for (int i = 0; i < count; i++) { lval_del(args[i]); }
+		return lval_err("Function passed incorrect number of arguments!");
+	}
+
+	//let slots are empty until a let sets them
+	lval_guard(e, c);
+	lval* local[LFRAME_LOCAL];
+	int m = n + c->lets->count;
+	int size = m + c->vals->count;
+	lval** frame = size <= LFRAME_LOCAL ? local : malloc(sizeof(lval*) * size);
+	if (frame == local) { allocs_avoided++; }
+	for (int i = 0; i < n; i++) { frame[i] = args[i]; }
+	for (int i = n; i < m; i++) { frame[i] = NULL; }
+	for (int i = 0; i < c->vals->count; i++) { frame[m+i] = c->vals->cell[i]; }
+
+	lval* fn = e->fn;
+	lval** outer = e->frame;
+	int outer_count = e->frame_count;
+	e->fn = f;
+	e->frame = frame;
+	e->frame_count = size;
+
+	lval* x;
+	if (use_vm) {
+		//macros defined after the lambda was made are expanded now
+		if (c->chunk == NULL) {
+			c->body = lval_expand_code(e, f, c->body);
+			c->chunk = lval_compile_code(e, c->body);
+			lchunk_tail(c->chunk);
+		}
+		x = lchunk_run(e, c->chunk);
+	} else {
+		lval* b = lval_thaw(lval_copy(c->body));
+		b->type = LVAL_SEXPR;
+		x = lval_eval_tail(e, b, 1);
+	}
+	if (e->tail && x) {
+		lval_del(x);
+		x = NULL;
+	}
+
+	e->fn = fn;
+	e->frame = outer;
+	e->frame_count = outer_count;
+	for (int i = 0; i < m; i++) {
+		if (frame[i]) { lval_del(frame[i]); }
+	}
+	if (frame != local) { free(frame); }
+	return x;
+}
+
+//does lambda f take any argument lazily
+int lval_lazy(lval* f) {
+	return f->type == LVAL_FUN && f->closure && f->closure->lazy;
+}
+
+//does lambda f take argument i lazily
+int lval_lazy_arg(lval* f, int i) {
+	return lval_lazy(f) && i < f->closure->formals->count && f->closure->lazy[i];
+}
+
+//a thunk for code, or for the chunk the vm compiled it to, which is
+//then borrowed. Values are already what they evaluate to. The thunk
+//record is allocated along with the lval, so a thunk is one allocation
+lval* lval_thunk(lenv* e, lval* code, lchunk* chunk) {
+	if (chunk == NULL && code->type != LVAL_SEXPR && code->type != LVAL_SYM) {
+		return code;
+	}
+	lval* v = lval_alloc(sizeof(lval) + sizeof(lthunk));
+	v->type = LVAL_THUNK;
+	v->thunk = (lthunk*)(v + 1);
+	v->thunk->code = code;
+	v->thunk->chunk = chunk;
+	v->thunk->fn = e->fn;
+	v->thunk->frame = e->frame;
+	v->thunk->frame_count = e->frame_count;
+	return v;
+}
+
+//evaluate a thunk where it was written, and turn it into the value in
+//place so everything holding it sees the value from then on
+void lval_force(lenv* e, lval* t) {
+	lthunk* k = t->thunk;
+	lval* fn = e->fn;
+	lval** frame = e->frame;
+	int frame_count = e->frame_count;
+	e->fn = k->fn;
+	e->frame = k->frame;
+	e->frame_count = k->frame_count;
+	lval* x = k->chunk ? lchunk_run(e, k->chunk) : lval_eval(e, k->code);
+	e->fn = fn;
+	e->frame = frame;
+	e->frame_count = frame_count;
+
+	x = lval_thaw(x);
+	*t = *x;
+	free(x);
+}
+
+//specializations made so far as {hash {f args...} lambda}, the oldest
+//is dropped once there are SPEC_CACHE of them
+#define SPEC_CACHE 64
+lval* spec_cache = NULL;
+
+//specialize f c1 c2 ... gives a lambda taking the rest of f's arguments
+//with the first ones fixed to c1 c2 ..., where everything that only
+//depends on those has been computed. The same lambda and values give
+//back the specialization made the first time
+lval* builtin_specialize(lenv* e, lval* a) {
+	LASSERT(a, a->count > 0 && a->cell[0]->type == LVAL_FUN && a->cell[0]->closure,
+		"Function 'specialize' passed incorrect type!");
+	LASSERT(a, a->count-1 <= a->cell[0]->closure->formals->count,
+		"Function 'specialize' passed too many arguments!");
+
+	if (spec_cache == NULL) { spec_cache = lval_qexpr(); }
+	long h = (long)lval_hash(a);
+	for (int i = 0; i < spec_cache->count; i++) {
+		lval* x = spec_cache->cell[i];
+		if (x->cell[0]->num == h && lval_eq(x->cell[1], a)) {
+			lval_del(a);
+			return lval_copy(x->cell[2]);
+		}
+	}
+
+	lval* f = lval_specialize(e, a->cell[0], a);
+	if (spec_cache->count == SPEC_CACHE) { lval_del(lval_pop(spec_cache, 0)); }
+	lval* x = lval_qexpr();
+	lval_add(x, lval_num(h));
+	lval_add(x, a);
+	lval_add(x, lval_copy(f));
+	lval_add(spec_cache, x);
+	return f;
+}
+
+//the residual lambda of f with its first arguments fixed to the rest of
+//a. They become captured values along with what f captured, numbers
+//are substituted into the body and lists where a pure builtin takes
+//them, then the body is partially evaluated
+lval* lval_specialize(lenv* e, lval* f, lval* a) {
+	lclosure* c = f->closure;
+	int n = c->formals->count;
+	int k = a->count-1;
+
+	//what each of f's frame slots is known to hold, NULL for arguments
+	//that are still free
+	int m = n + c->lets->count;
+	lval** slots = malloc(sizeof(lval*) * (m + c->vals->count));
+	for (int i = 0; i < m; i++) { slots[i] = i < k ? a->cell[i+1] : NULL; }
+	for (int i = 0; i < c->vals->count; i++) { slots[m+i] = c->vals->cell[i]; }
+	lval* body = lval_copy(c->outline ? c->outline : c->body);
+	if (!lval_deep(body)) { body = lval_peval(e, slots, body, 0); }
+	free(slots);
+
+	lval* formals = lval_qexpr();
+	lval* names = lval_qexpr();
+	lval* vals = lval_qexpr();
+	for (int i = 0; i < n; i++) {
+		lval_add(i < k ? names : formals, lval_copy(c->formals->cell[i]));
+		if (i < k) { lval_add(vals, lval_copy(a->cell[i+1])); }
+	}
+	for (int i = 0; i < c->names->count; i++) {
+		lval_add(names, lval_copy(c->names->cell[i]));
+		lval_add(vals, lval_copy(c->vals->cell[i]));
+	}
+
+	//the body only sees its own record, not the lambda running now
+	lval* x = lval_closure(formals, names, vals, body);
+	if (c->lazy && k < n) {
+		x->closure->lazy = malloc(n - k);
+		memcpy(x->closure->lazy, c->lazy + k, n - k);
+	}
+	lval* fn = e->fn;
+	e->fn = NULL;
+	lval_convert(e, x, body);
+	e->fn = fn;
+	return x;
+}
+
+//partially evaluate code v, where slots says what the frame slots its
+//symbols refer to hold. data is set when v is an argument of a pure
+//builtin, lists can only be substituted there. A Q-expression is code
+//here and stays code, a value it folds to is put in a list
+lval* lval_peval(lenv* e, lval** slots, lval* v, int data) {
+	if (v->type == LVAL_SYM) {
+		lval* x = v->local != -1 ? slots[v->local] : NULL;
+		if (x && (x->type == LVAL_NUM || data)) {
+			lval_del(v);
+			return lval_copy(x);
+		}
+		return v;
+	}
+	if (v->type == LVAL_SEXPR) { return lval_peval_expr(e, slots, v); }
+	if (v->type != LVAL_QEXPR || v->refs) { return v; }
+
+	v->type = LVAL_SEXPR;
+	lval* x = lval_peval_expr(e, slots, v);
+	if (x->type == LVAL_SEXPR) {
+		x->type = LVAL_QEXPR;
+		return x;
+	}
+	lval* y = lval_qexpr();
+	lval_add(y, x);
+	return y;
+}
+
+//fold pure applications on constants, if on a constant condition and
+//eval of a constant
+lval* lval_peval_expr(lenv* e, lval** slots, lval* v) {
+	lbuiltin f = lval_head(e, v);
+	if (f == builtin_lambda) { return v; }
+
+	int pure = lval_pure(f);
+	for (int i = 0; i < v->count; i++) {
+		int code = lval_code_arg(f, i);
+		int t = v->cell[i]->type;
+		if (t == LVAL_QEXPR && !code) { continue; }
+		lval* x = lval_peval(e, slots, v->cell[i], pure && i > 0);
+
+		//a list folded from an expression where a special form expects
+		//code has to stay a value
+		if (code && f != builtin_eval && t == LVAL_SEXPR && x->type == LVAL_QEXPR) {
+			lval* y = lval_sexpr();
+			lval_add(y, x);
+			x = y;
+		}
+		v->cell[i] = x;
+	}
+
+	//eval of code that has been folded to a constant
+	if (f == builtin_eval && v->count == 2 && v->cell[1]->type == LVAL_QEXPR
+		&& v->cell[1]->count == 1 && (v->cell[1]->cell[0]->type == LVAL_NUM
+		|| v->cell[1]->cell[0]->type == LVAL_QEXPR)) {
+		return lval_take(lval_thaw(lval_take(v, 1)), 0);
+	}
+
+	//the branch taken is code, and a missing else is ()
+	if (f == builtin_if && (v->count == 3 || v->count == 4)
+		&& v->cell[1]->type == LVAL_NUM) {
+		int i = v->cell[1]->num ? 2 : 3;
+		if (i == v->count) {
+			lval_del(v);
+			return lval_sexpr();
+		}
+		lval* x = lval_thaw(lval_take(v, i));
+		if (x->type == LVAL_QEXPR) { x->type = LVAL_SEXPR; }
+		return x;
+	}
+
+	if (!pure && f != builtin_and && f != builtin_or) { return v; }
+	if (v->count < 2) { return v; }
+	for (int i = 1; i < v->count; i++) {
+		int t = v->cell[i]->type;
+		if (t != LVAL_NUM && (t != LVAL_QEXPR || !pure)) { return v; }
+	}
+	lval* x = lval_eval(e, lval_copy(v));
+	if (x->type == LVAL_ERR) {
+		lval_del(x);
+		return v;
+	}
+	lval_del(v);
+	return x;
+}
+
+void lclosure_del(lclosure* c) {
+	lval_del(c->formals);
+	lval_del(c->names);
+	lval_del(c->vals);
+	lval_del(c->body);
+	if (c->chunk) { lchunk_del(c->chunk); }
+	free(c->lazy);
+	lval_del(c->lets);
+	if (c->outline) { lval_del(c->outline); }
+	lval_del(c->inlined);
+	lval_del(c->callees);
+	free(c);
+}
+
+//memo f [size] wraps a function that only depends on its arguments,
+//calls with arguments it has seen before give back the kept result
+lval* builtin_memo(lenv* e, lval* a) {
+	LASSERT(a, a->count == 1 || a->count == 2,
+		"Function 'memo' passed incorrect number of arguments!");
+	LASSERT(a, a->cell[0]->type == LVAL_FUN && !lval_special(a->cell[0]->fun),
+		"Function 'memo' passed incorrect type!");
+	LASSERT(a, a->count == 1 || (a->cell[1]->type == LVAL_NUM
+		&& a->cell[1]->num > 0 && a->cell[1]->num <= INT_MAX / 2),
+		"Function 'memo' passed incorrect size!");
+
+	int size = a->count == 2 ? a->cell[1]->num : MEMO_SIZE;
+	lval* f = lval_memo(lval_pop(a, 0), size);
+	lval_del(a);
+	return f;
+}
+
+//memo-stats f gives {hits misses entries size} of a memoized function
+lval* builtin_memo_stats(lenv* e, lval* a) {
+	LASSERT(a, a->count == 1 && a->cell[0]->type == LVAL_FUN && a->cell[0]->memo,
+		"Function 'memo-stats' passed incorrect type!");
+
+	lmemo* m = a->cell[0]->memo;
+	lval* x = lval_qexpr();
+	lval_add(x, lval_num(m->hits));
+	lval_add(x, lval_num(m->misses));
+	lval_add(x, lval_num(m->count));
+	lval_add(x, lval_num(m->size));
+	lval_del(a);
+	return x;
+}
+
+lval* lval_memo(lval* fn, int size) {
+	lmemo* m = malloc(sizeof(lmemo));
+	m->refs = 1;
+	m->fn = fn;
+	m->size = size;
+	m->count = 0;
+	m->buckets_count = 1;
+	while (m->buckets_count < size) { m->buckets_count *= 2; }
+	m->buckets = malloc(sizeof(int) * m->buckets_count);
+	for (int i = 0; i < m->buckets_count; i++) { m->buckets[i] = -1; }
+	m->entries = malloc(sizeof(lmemo_entry) * size);
+	m->newest = -1;
+	m->oldest = -1;
+	m->hits = 0;
+	m->misses = 0;
+	m->macro = 0;
+	m->time = 0;
+
+	lval* f = lval_fun(NULL);
+	f->memo = m;
+	return f;
+}
+
+//look the arguments up by their structural hash, and call the wrapped
+//function when they aren't there. Errors are handed back but not kept
+lval* lval_call_memo(lenv* e, lval* f, lval* a) {
+	lmemo* m = f->memo;
+	unsigned long h = lval_hash(a);
+	int b = h & (m->buckets_count - 1);
+	for (int i = m->buckets[b]; i != -1; i = m->entries[i].next) {
+		lmemo_entry* x = &m->entries[i];
+		if (x->hash == h && lval_eq(x->args, a)) {
+			m->hits++;
+			lmemo_touch(m, i);
+			lval_del(a);
+			return lval_copy(x->val);
+		}
+	}
+	m->misses++;
+
+	//the call can reach this wrapper again, so the entry is only
+	//claimed once it is done
+	lval* args = lval_copy(a);
+	clock_t start = m->macro ? clock() : 0;
+	lval* v = m->macro ? lval_template(m->fn->closure, a) : lval_invoke(e, m->fn, a);
+	if (m->macro) { m->time += clock() - start; }
+	if (v->type == LVAL_ERR) {
+		lval_del(args);
+		return v;
+	}
+
+	int i;
+	if (m->count < m->size) {
+		i = m->count++;
+	} else {
+		//unlink the least recently used entry from its bucket and the
+		//lru list, and reuse it
+		i = m->oldest;
+		lmemo_entry* x = &m->entries[i];
+		int* p = &m->buckets[x->hash & (m->buckets_count - 1)];
+		while (*p != i) { p = &m->entries[*p].next; }
+		*p = x->next;
+		m->oldest = x->newer;
+		if (m->oldest != -1) {
+			m->entries[m->oldest].older = -1;
+		} else {
+			m->newest = -1;
+		}
+		lval_del(x->args);
+		lval_del(x->val);
+	}
+
+	lmemo_entry* x = &m->entries[i];
+	x->hash = h;
+	x->args = args;
+	x->val = lval_copy(v);
+	x->next = m->buckets[b];
+	m->buckets[b] = i;
+	x->older = m->newest;
+	x->newer = -1;
+	if (m->newest != -1) { m->entries[m->newest].newer = i; }
+	m->newest = i;
+	if (m->oldest == -1) { m->oldest = i; }
+	return v;
+}
+
+//move entry i to the front of the lru list
+void lmemo_touch(lmemo* m, int i) {
+	lmemo_entry* x = &m->entries[i];
+	if (m->newest == i) { return; }
+	m->entries[x->newer].older = x->older;
+	if (x->older != -1) {
+		m->entries[x->older].newer = x->newer;
+	} else {
+		m->oldest = x->newer;
+	}
+	x->older = m->newest;
+	x->newer = -1;
+	m->entries[m->newest].newer = i;
+	m->newest = i;
+}
+
+void lmemo_del(lmemo* m) {
+	for (int i = 0; i < m->count; i++) {
+		lval_del(m->entries[i].args);
+		lval_del(m->entries[i].val);
+	}
+	lval_del(m->fn);
+	free(m->buckets);
+	free(m->entries);
+	free(m);
+}
+
+//defmacro {name} {args} {body} binds name to a macro. A call of it is
+//replaced by the code in body with each of args, anywhere in it,
+//replaced by the code given for it in the call, unevaluated.
+//Expansions are kept by the code they were for
+long macros_defined = 0;
+
+lval* builtin_defmacro(lenv* e, lval* a) {
+	LASSERT(a, a->count == 3,
+		"Function 'defmacro' passed incorrect number of arguments!");
+	for (int i = 0; i < a->count; i++) {
+		LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
+			"Function 'defmacro' passed incorrect type!");
+	}
+	LASSERT(a, a->cell[0]->count == 1 && a->cell[0]->cell[0]->type == LVAL_SYM,
+		"Function 'defmacro' passed incorrect name!");
+	for (int i = 0; i < a->cell[1]->count; i++) {
+		LASSERT(a, a->cell[1]->cell[i]->type == LVAL_SYM,
+			"Function 'defmacro' cannot define non-symbol!");
+	}
+
+	lval* name = lval_pop(a, 0);
+	lval* formals = lval_pop(a, 0);
+	lval* body = lval_take(a, 0);
+	lval* f = lval_memo(lval_closure(formals, lval_qexpr(), lval_qexpr(), body),
+		MEMO_SIZE);
+	f->memo->macro = 1;
+	macros_defined++;
+	lenv_put(e, name->cell[0], f);
+	lval_del(name);
+	lval_del(f);
+	return lval_sexpr();
+}
+
+//macro-stats m gives {hits expansions ns}: the calls whose expansion
+//was kept, the calls that were expanded and the time that took
+lval* builtin_macro_stats(lenv* e, lval* a) {
+	LASSERT(a, a->count == 1 && lval_macro(a->cell[0]),
+		"Function 'macro-stats' passed incorrect type!");
+
+	lmemo* m = a->cell[0]->memo;
+	lval* x = lval_qexpr();
+	lval_add(x, lval_num(m->hits));
+	lval_add(x, lval_num(m->misses));
+	lval_add(x, lval_num((long)((double)m->time * 1e9 / CLOCKS_PER_SEC)));
+	lval_del(a);
+	return x;
+}
+
+int lval_macro(lval* f) {
+	return f->type == LVAL_FUN && f->memo && f->memo->macro;
+}
+
+//the body of macro c with its arguments replaced by the code in a,
+//which is consumed
+lval* lval_template(lclosure* c, lval* a) {
+	LASSERT(a, a->count == c->formals->count,
+		"Macro passed incorrect number of arguments!");
+	lval* x = lval_template_subst(c->formals, a, lval_copy(c->body));
+	lval_del(a);
+	return x;
+}
+
+lval* lval_template_subst(lval* formals, lval* a, lval* v) {
+	if (v->type == LVAL_SYM) { return lval_template_sym(formals, a, v); }
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+	while (s.count) {
+		lval* x = s.items[--s.count].v;
+		if ((x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) || x->refs) { continue; }
+		//the code substituted is left as it is
+		for (int i = 0; i < x->count; i++) {
+			lval* y = x->cell[i];
+			if (y->type == LVAL_SYM) {
+				x->cell[i] = lval_template_sym(formals, a, y);
+			} else {
+				lstack_push(&s, y, NULL, NULL, 0);
+			}
+		}
+	}
+	lstack_del(&s);
+	return v;
+}
+
+//the code given for v if it is one of the formals of a template
+lval* lval_template_sym(lval* formals, lval* a, lval* v) {
+	if (v->type != LVAL_SYM) { return v; }
+	for (int i = 0; i < formals->count; i++) {
+		if (strcmp(formals->cell[i]->sym, v->sym) == 0) {
+			lval_del(v);
+			return lval_copy(a->cell[i]);
+		}
+	}
+	return v;
+}
+
+//expand a call of macro f on the code in a, which is consumed. The
+//expansion is found by the code alone, so frame slots from the lambda
+//it is in are cleared first and given again for the lambda running now
+lval* lval_expand_call(lenv* e, lval* f, lval* a) {
+	lval_unclose(a);
+	lval* x = lval_thaw(lval_call_memo(e, f, a));
+	if (x->type == LVAL_QEXPR) { x->type = LVAL_SEXPR; }
+	if (e->fn) { lval_close(e, e->fn, x, NULL); }
+	return x;
+}
+
+//expand the macro calls in code v before it runs, so running it again
+//never expands them again. f is the lambda v is the body of, whose
+//arguments hide macros of the same name. Expansions are expanded in
+//turn, and Q-expressions are only entered where they are code. A call
+//whose expansion fails is left to give the error when it runs
+lval* lval_expand(lenv* e, lval* f, lval* v) {
+	while (v->type == LVAL_SEXPR && v->count > 1 && v->cell[0]->type == LVAL_SYM
+		&& !lval_caller_local(e, f, v->cell[0]->sym)) {
+		int k = lenv_slot(e, v->cell[0]);
+		if (k == -1 || !lval_macro(e->vals[k])) { break; }
+
+		lval* a = lval_copy(v);
+		lval_del(lval_pop(a, 0));
+		lval* x = lval_expand_call(e, e->vals[k], a);
+		if (x->type == LVAL_ERR) {
+			lval_del(x);
+			return v;
+		}
+		lval_del(v);
+		v = x;
+	}
+	if ((v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) || v->refs) { return v; }
+
+	//lambda bodies are expanded when the lambda is made, once their
+	//arguments are known
+	lbuiltin g = lval_head(e, v);
+	if (g == builtin_lambda) { return v; }
+	for (int i = 0; i < v->count; i++) {
+		if (v->cell[i]->type != LVAL_QEXPR) {
+			v->cell[i] = lval_expand(e, f, v->cell[i]);
+		} else if (lval_code_arg(g, i)) {
+			v->cell[i] = lval_expand_code(e, f, v->cell[i]);
+		}
+	}
+	if (g == builtin_let && lval_let_form(v)) {
+		lval* b = v->cell[1];
+		for (int i = 1; i < b->count; i += 2) {
+			if (b->cell[i]->type != LVAL_QEXPR) { b->cell[i] = lval_expand(e, f, b->cell[i]); }
+		}
+	}
+	return v;
+}
+
+//expand code held in a Q-expression, which stays one. Shared literals
+//have no calls in them
+lval* lval_expand_code(lenv* e, lval* f, lval* v) {
+	if (v->refs || lval_deep(v)) { return v; }
+	v->type = LVAL_SEXPR;
+	v = lval_expand(e, f, v);
+	if (v->type == LVAL_SEXPR) {
+		v->type = LVAL_QEXPR;
+		return v;
+	}
+	return lval_add(lval_qexpr(), v);
+}
+
+//forget the frame slots symbols in v were given
+void lval_unclose(lval* v) {
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+	while (s.count) {
+		lval* x = s.items[--s.count].v;
+		if (x->type == LVAL_SYM) { x->local = -1; }
+		if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { continue; }
+		for (int i = 0; i < x->count; i++) { lstack_push(&s, x->cell[i], NULL, NULL, 0); }
+	}
+	lstack_del(&s);
+}
+
+lval* builtin_head(lenv* e, lval* a) {
+	//check error conditions
+	LASSERT(a, a->count == 1,
+		"Function 'head' passed too many arguments!");
+	LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+		"Function 'head' passed incorrect types!");
+	LASSERT(a, a->cell[0]->count != 0,
+		"Function 'head' passed {}!");
+
+	//otherwise take first argument
+	lval* v = lval_thaw(lval_take(a, 0));
+
+	//delete all elements that are not head and return
+	while (v->count > 1) {
+		lval_del(lval_pop(v, 1));
+	}
+	return v;
+}
+
+lval* builtin_tail(lenv* e, lval* a) {
+	//check error conditions
+	LASSERT(a, a->count == 1,
+		"Function 'tail' passed too many arguments!");
+	LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+		"Function 'tail' passed incorrect types!");
+	LASSERT(a, a->cell[0]->count != 0,
+		"Function 'tail' passed {}!");
+
+	//otherwise take first argument
+	lval* v = lval_thaw(lval_take(a, 0));
+
+	//delete all elements that are not head and return
+	lval_del(lval_pop(v, 0));
+	return v;
+}
+
+
+lval* builtin_list(lenv* e, lval* a) {
 	a->type = LVAL_QEXPR;
 	return a;
 }
 
-lval* builtin_eval(lval* a) {
-	 if (a->count != 1) {
-		 return lval_err("Function 'eval' passed too many arguments!");
-	 }
+lval* builtin_eval(lenv* e, lval* a) {
+	LASSERT(a, a->count == 1,
+		"Function 'eval' passed too many arguments!");
+	LASSERT(a, a->cell[0]->type == LVAL_QEXPR,
+		"Function 'eval' passed incorrect type!");
+
+	if (use_vm) {
+		lval* x = lval_eval_code(e, a->cell[0], 0);
+		lval_del(a);
+		return x;
+	}
+	lval* x = lval_thaw(lval_take(a, 0));
+	x->type = LVAL_SEXPR;
+	return lval_eval(e, x);
+}
+
+//code eval has compiled, replaced round robin once there are
+//EVAL_CACHE of them
+leval eval_cache[EVAL_CACHE];
+int eval_cache_count = 0;
+int eval_cache_next = 0;
+long eval_hits = 0;
+long eval_misses = 0;
+int eval_depth = 0;
+
+//eval-stats {} gives {hits misses entries} of the code eval has
+//compiled
+lval* builtin_eval_stats(lenv* e, lval* a) {
+	LASSERT(a, a->count == 1 && a->cell[0]->count == 0
+		&& (a->cell[0]->type == LVAL_SEXPR || a->cell[0]->type == LVAL_QEXPR),
+		"Function 'eval-stats' passed incorrect type!");
+	lval* x = lval_qexpr();
+	lval_add(x, lval_num(eval_hits));
+	lval_add(x, lval_num(eval_misses));
+	lval_add(x, lval_num(eval_cache_count));
+	lval_del(a);
+	return x;
+}
+
+//evaluate the code in Q-expression x, which is left alone, in vm mode.
+//The chunk compiled the first time the same code was evaluated is run
+//again, so the code is neither copied nor analysed again. bound is set
+//when x is the value of a global name. Past EVAL_DEPTH nested evals the
+//tree walker takes over, it runs eval in tail position without
+//recursing
+lval* lval_eval_code(lenv* e, lval* x, int bound) {
+	int i = eval_depth < EVAL_DEPTH ? leval_find(e, x, bound) : -1;
+	if (i == -1) {
+		lval* v = lval_thaw(lval_copy(x));
+		v->type = LVAL_SEXPR;
+		return lval_eval(e, v);
+	}
+
+	leval* c = &eval_cache[i];
+	if (bound) {
+		c->src = x;
+		c->version = e->version;
+	}
+	c->running++;
+	eval_depth++;
+	lval* r = lchunk_run(e, c->chunk);
+	eval_depth--;
+	c->running--;
+	return r;
+}
+
+//index of the cache entry for code x, compiling it into one if there
+//is none. -1 if x can't be kept: symbols in it index the frame of a
+//lambda, or every entry is running
+int leval_find(lenv* e, lval* x, int bound) {
+	for (int i = 0; i < eval_cache_count && bound; i++) {
+		if (eval_cache[i].src == x && eval_cache[i].version == e->version
+			&& eval_cache[i].macros == macros_defined) {
+			eval_hits++;
+			return i;
+		}
+	}
+	if (!lval_open(x)) { return -1; }
+
+	unsigned long h = lval_hash(x);
+	for (int i = 0; i < eval_cache_count; i++) {
+		if (eval_cache[i].hash == h && eval_cache[i].macros == macros_defined
+			&& lval_eq(eval_cache[i].code, x)) {
+			eval_hits++;
+			return i;
+		}
+	}
+
+	int i = eval_cache_count;
+	if (i == EVAL_CACHE) {
+		for (int k = 0; k < EVAL_CACHE && i == EVAL_CACHE; k++) {
+			int j = (eval_cache_next + k) % EVAL_CACHE;
+			if (eval_cache[j].running == 0) { i = j; }
+		}
+		if (i == EVAL_CACHE) { return -1; }
+		eval_cache_next = (i + 1) % EVAL_CACHE;
+		lval_del(eval_cache[i].code);
+		lchunk_del(eval_cache[i].chunk);
+	} else {
+		eval_cache_count++;
+	}
+	eval_misses++;
+
+	//macros are expanded once here, as for any code about to run
+	lval* v = lval_expand_code(e, NULL, lval_copy(x));
+	leval c = { h, lval_copy(x), lval_compile_code(e, v), NULL, -1,
+		macros_defined, 0 };
+	lval_del(v);
+	eval_cache[i] = c;
+	return i;
+}
+
+//are all symbols in v globals, rather than indexing a lambda's frame
+int lval_open(lval* v) {
+	int r = 1;
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+	while (s.count && r) {
+		lval* x = s.items[--s.count].v;
+		if (x->type == LVAL_SYM) { r = x->local == -1; }
+		if (x->type != LVAL_SEXPR && x->type != LVAL_QEXPR) { continue; }
+		for (int i = 0; i < x->count; i++) { lstack_push(&s, x->cell[i], NULL, NULL, 0); }
+	}
+	lstack_del(&s);
+	return r;
+}
+
+lval* builtin_join(lenv* e, lval* a) {
+	for (int i = 0; i < a->count; i++) {
+		LASSERT(a, a->cell[i]->type == LVAL_QEXPR,
+			"Function 'join' passed incorrect type.");
+	}
+
+	lval* x = lval_thaw(lval_pop(a, 0));
+
+	while (a->count) {
+		x = lval_join(x, lval_thaw(lval_pop(a, 0)));
+	}
+
+	lval_del(a);
+	return x;
+}
+
+//def is a special form, the values are only evaluated once the list
+//of names has been checked, then all of them are and the first error
+//is the result as for any other builtin
+lval* builtin_def(lenv* e, lval* a) {
+	if (a->count > 0) { a->cell[0] = lval_eval(e, a->cell[0]); }
+	if (a->count > 0 && a->cell[0]->type == LVAL_ERR) { return lval_take(a, 0); }
+	LASSERT(a, a->count > 0 && a->cell[0]->type == LVAL_QEXPR,
+		"Function 'def' passed incorrect type!");
+
+	//first argument is the list of symbols to bind
+	lval* syms = a->cell[0];
+	for (int i = 0; i < syms->count; i++) {
+		LASSERT(a, syms->cell[i]->type == LVAL_SYM,
+			"Function 'def' cannot define non-symbol!");
+	}
+	LASSERT(a, syms->count == a->count-1,
+		"Function 'def' cannot define incorrect number of values to symbols!");
+
+	for (int i = 1; i < a->count; i++) {
+		a->cell[i] = lval_eval(e, a->cell[i]);
+	}
+	for (int i = 1; i < a->count; i++) {
+		if (a->cell[i]->type == LVAL_ERR) { return lval_take(a, i); }
+	}
+
+	//bind a copy of each value to its symbol
+	for (int i = 0; i < syms->count; i++) {
+		lenv_put(e, syms->cell[i], a->cell[i+1]);
+	}
+
+	lval_del(a);
+	return lval_sexpr();
+}
+
+//evaluate a Q-expression n times and report the time it took, in vm
+//mode it is compiled once up front, the tree walker has to copy it
+lval* builtin_bench(lenv* e, lval* a) {
+	LASSERT(a, a->count == 2,
+		"Function 'bench' passed incorrect number of arguments!");
+	LASSERT(a, a->cell[0]->type == LVAL_NUM && a->cell[0]->num > 0,
+		"Function 'bench' passed incorrect iteration count!");
+	LASSERT(a, a->cell[1]->type == LVAL_QEXPR,
+		"Function 'bench' passed incorrect type!");
+
+	long n = a->cell[0]->num;
+	lval* body = lval_thaw(lval_pop(a, 1));
+	body->type = LVAL_SEXPR;
+	if (!lval_deep(body)) { body = lval_expand(e, NULL, body); }
+	body = lval_resolve(e, lval_inline_expr(e, body));
+	if (body->type == LVAL_ERR) {
+		lval_del(a);
+		return body;
+	}
+
+	lval* x = NULL;
+	long allocs = lval_allocs;
+	long bytes = lval_bytes;
+	long avoided = allocs_avoided;
+	long iters = loop_iters;
+	clock_t start = clock();
+	if (use_vm) {
+		lchunk* c = lval_compile(e, body);
+		for (long i = 0; i < n; i++) {
+			if (x) { lval_del(x); }
+			x = lchunk_run(e, c);
+		}
+		lchunk_del(c);
+	} else {
+		for (long i = 0; i < n; i++) {
+			if (x) { lval_del(x); }
+			x = lval_eval(e, lval_copy(body));
+		}
+	}
+	double ms = (double)(clock() - start) * 1000.0 / CLOCKS_PER_SEC;
+
+	allocs = lval_allocs - allocs;
+	bytes = lval_bytes - bytes;
+	avoided = allocs_avoided - avoided;
+	iters = loop_iters - iters;
+
+	printf("bench: %li iterations in %.3f ms (%.1f ns/iter, %.1f allocs/iter, %.1f bytes/iter, %.1f avoided, %s)\n",
+		n, ms, ms * 1e6 / n, (double)allocs / n, (double)bytes / n, (double)avoided / n,
+		use_vm ? "vm" : "tree");
+	if (iters) {
+		printf("bench: %li loop iterations, %.0f per second, %.2f allocs each\n",
+			iters, iters / (ms / 1000.0), (double)allocs / iters);
+	}
+	lval_del(body);
+	lval_del(a);
+	return x;
+}
+
+//switch the jit off (0), on (1) or on with every native result
+//checked against lval_eval (2)
+lval* builtin_jit(lenv* e, lval* a) {
+	LASSERT(a, a->count == 1 && a->cell[0]->type == LVAL_NUM,
+		"Function 'jit' passed incorrect type!");
+	LASSERT(a, a->cell[0]->num >= 0 && a->cell[0]->num <= 2,
+		"Function 'jit' expects 0, 1 or 2!");
+
+	use_jit = a->cell[0]->num;
+	lval_del(a);
+	return lval_sexpr();
+}
+
+//inline cache counters, ic 1 returns {hits misses} and ic 0 resets them
+lval* builtin_ic(lenv* e, lval* a) {
+	LASSERT(a, a->count == 1 && a->cell[0]->type == LVAL_NUM,
+		"Function 'ic' passed incorrect type!");
+	LASSERT(a, a->cell[0]->num == 0 || a->cell[0]->num == 1,
+		"Function 'ic' expects 0 or 1!");
+
+	lval* x = lval_qexpr();
+	if (a->cell[0]->num) {
+		lval_add(x, lval_num(ic_hits));
+		lval_add(x, lval_num(ic_misses));
+	} else {
+		ic_hits = 0;
+		ic_misses = 0;
+	}
+	lval_del(a);
+	return x;
+}
+
+lval* builtin_print(lenv* e, lval* a) {
+	for (int i = 0; i < a->count; i++) {
+		lval_print(a->cell[i]);
+		if (i != (a->count-1)) {
+			putchar(' ');
+		}
+	}
+	putchar('\n');
+	lval_del(a);
+	return lval_sexpr();
+}
+
+//apply a builtin to arguments that are already evaluated, with the
+//same error checking as lval_apply
+lval* lval_call(lenv* e, lbuiltin f, lval* a) {
+	for (int i = 0; i < a->count; i++) {
+		if (a->cell[i]->type == LVAL_ERR) { return lval_take(a, i); }
+	}
+	return f(e, a);
+}
+
+//evaluate every expression in a file, only errors are printed
+void lval_load(lenv* e, mpc_parser_t* p, char* filename) {
+	mpc_result_t r;
+	if (!mpc_parse_contents(filename, p, &r)) {
+		mpc_err_print(r.error);
+		mpc_err_delete(r.error);
+		return;
+	}
+
+	lval* expr = lval_read(r.output);
+	mpc_ast_delete(r.output);
+
+	while (expr->count) {
+		lval* x = lval_pop(expr, 0);
+		x = lval_run(e, x);
+		if (x->type == LVAL_ERR) { lval_println(x); }
+		lval_del(x);
+	}
+	lval_del(expr);
+}
+
+lval* lval_join(lval* x, lval* y) {
+	//for each cell in 'y' join it with 'x'
+	while (y->count) {
+		x = lval_add(x, lval_pop(y, 0));
+	}
+
+	//delete the empty list 'y' and return 'x'
+	lval_del(y);
+	return x;
+}
+
+void lval_print(lval* v) {
+	//frames hold a list and the index of the next cell to print
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+
+	while (s.count) {
+		lwork* w = &s.items[s.count-1];
+		lval* x = w->v;
+		switch (x->type) {
+			case LVAL_NUM: 
+				printf("%li", x->num);
+				break;
+			case LVAL_BIG: {
+				char* d = lbig_str(x);
+				printf("%s", d);
+				free(d);
+				break;
+			}
+			case LVAL_DBL: {
+				char d[32];
+				ldbl_str(d, x->dbl);
+				printf("%s", d);
+				break;
+			}
+			case LVAL_ERR:
+				printf("Error: %s", x->err);
+				break;
+			case LVAL_SYM:
+				printf("%s", x->sym);
+				break;
+			case LVAL_FUN: 
+				if (x->closure) {
+					printf("(\\ ");
+					lval_print_formals(x->closure);
+					putchar(' ');
+					lval_print(x->closure->outline ? x->closure->outline
+						: x->closure->body);
+					putchar(')');
+				} else if (x->memo) {
+					printf(x->memo->macro ? "(macro " : "(memo ");
+					lval_print(x->memo->fn);
+					putchar(')');
+				} else {
+					printf("<function>");
+				}
+				break;
+			case LVAL_THUNK:
+				printf("<thunk>");
+				break;
+
+			case LVAL_SEXPR:
+			case LVAL_QEXPR:
+				if (w->i == 0) {
+					putchar(x->type == LVAL_SEXPR ? '(' : '{');
+				}
+				if (w->i < x->count) {
+					//don't print trailing spaces
+					if (w->i > 0) { putchar(' '); }
+					w->i++;
+					lstack_push(&s, x->cell[w->i-1], NULL, NULL, 0);
+					continue;
+				}
+				putchar(x->type == LVAL_SEXPR ? ')' : '}');
+				break;
+		}
+		s.count--;
+	}
+	lstack_del(&s);
+}
+
+//formals of a lambda, with the lazy ones written as they were
+void lval_print_formals(lclosure* c) {
+	putchar('{');
+	for (int i = 0; i < c->formals->count; i++) {
+		if (i > 0) { putchar(' '); }
+		if (c->lazy && c->lazy[i]) { putchar('~'); }
+		lval_print(c->formals->cell[i]);
+	}
+	putchar('}');
+}
+
+void lval_println(lval* v) {
+	 lval_print(v);
+	 putchar('\n');
+}
+
+//copy a single value, lists get a cell array of the right size for
+//lval_copy to fill in
+lval* lval_copy_node(lval* v) {
+	lval* x = lval_alloc(sizeof(lval) + (v->type == LVAL_THUNK ? sizeof(lthunk) : 0));
+	x->type = v->type;
+
+	switch (v->type) {
+		//copy functions and numbers directly
+		//lambdas share their closure record
+		case LVAL_FUN:
+			x->fun = v->fun;
+			x->closure = v->closure;
+			x->memo = v->memo;
+			if (x->closure) { x->closure->refs++; }
+			if (x->memo) { x->memo->refs++; }
+			break;
+		case LVAL_NUM:
+			x->num = v->num;
+			break;
+		case LVAL_BIG:
+			x->num = v->num;
+			x->limbs_count = v->limbs_count;
+			x->limbs = malloc(sizeof(unsigned int) * (v->limbs_count + 1));
+			lval_bytes += sizeof(unsigned int) * (v->limbs_count + 1);
+			memcpy(x->limbs, v->limbs, sizeof(unsigned int) * v->limbs_count);
+			break;
+		case LVAL_DBL:
+			x->dbl = v->dbl;
+			break;
+		case LVAL_THUNK:
+			x->thunk = (lthunk*)(x + 1);
+			*x->thunk = *v->thunk;
+			if (v->thunk->code) { x->thunk->code = lval_copy(v->thunk->code); }
+			break;
+
+		//copy strings using malloc and strcpy
+		case LVAL_ERR:
+			x->err = malloc(strlen(v->err) + 1);
+			lval_bytes += strlen(v->err) + 1;
+			strcpy(x->err, v->err);
+			break;
+		case LVAL_SYM:
+			x->sym = malloc(strlen(v->sym) + 1);
+			lval_bytes += strlen(v->sym) + 1;
+			strcpy(x->sym, v->sym);
+			x->slot = v->slot;
+			x->version = v->version;
+			x->local = v->local;
+			break;
+
+		case LVAL_SEXPR:
+		case LVAL_QEXPR:
+			x->count = v->count;
+			x->cell = malloc(sizeof(lval*) * x->count);
+			lval_bytes += sizeof(lval*) * x->count;
+			break;
+	}
+	return x;
+}
+
+//shared literals are not copied, the copy is another reference
+lval* lval_copy(lval* v) {
+	if (v->refs) {
+		v->refs++;
+		allocs_avoided++;
+		return v;
+	}
+	lval* x = lval_copy_node(v);
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return x; }
+
+	//copy lists by copying each sub-expression, with a frame for every
+	//list whose cells still need filling in
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, x, NULL, 0);
+	while (s.count) {
+		lwork w = s.items[--s.count];
+		for (int i = 0; i < w.v->count; i++) {
+			lval* y = w.v->cell[i];
+			if (y->refs) {
+				y->refs++;
+				allocs_avoided++;
+				w.x->cell[i] = y;
+				continue;
+			}
+			w.x->cell[i] = lval_copy_node(y);
+			if (y->type == LVAL_SEXPR || y->type == LVAL_QEXPR) {
+				lstack_push(&s, y, w.x->cell[i], NULL, 0);
+			}
+		}
+	}
+	lstack_del(&s);
+	return x;
+}
+
+//v as a value that can be changed in place, for code that takes it
+//apart or reuses it for a result. A shared literal held only by the
+//caller stops being shared, otherwise the caller gets its own node
+//with the same shared elements
+lval* lval_thaw(lval* v) {
+	if (v->refs == 0 || --v->refs == 0) { return v; }
+	lval* x = lval_copy_node(v);
+	if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) {
+		for (int i = 0; i < v->count; i++) { x->cell[i] = lval_copy(v->cell[i]); }
+	}
+	return x;
+}
+
+//structural equality, comparing pairs off a work stack
+int lval_eq(lval* x, lval* y) {
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, x, y, NULL, 0);
+
+	int r = 1;
+	while (s.count && r) {
+		lwork w = s.items[--s.count];
+		if (w.v->type != w.x->type) { r = 0; break; }
+
+		switch (w.v->type) {
+			case LVAL_NUM: r = w.v->num == w.x->num; break;
+			case LVAL_BIG: r = lbig_cmp(w.v, w.x) == 0; break;
+			case LVAL_DBL: r = w.v->dbl == w.x->dbl; break;
+			case LVAL_ERR: r = strcmp(w.v->err, w.x->err) == 0; break;
+			case LVAL_SYM: r = strcmp(w.v->sym, w.x->sym) == 0; break;
+			case LVAL_FUN:
+				r = w.v->fun == w.x->fun && w.v->closure == w.x->closure
+					&& w.v->memo == w.x->memo;
+				break;
+
+			case LVAL_SEXPR:
+			case LVAL_QEXPR:
+				r = w.v->count == w.x->count;
+				for (int i = 0; i < w.v->count && r; i++) {
+					lstack_push(&s, w.v->cell[i], w.x->cell[i], NULL, 0);
+				}
+				break;
+		}
+	}
+	lstack_del(&s);
+	return r;
+}
+
+//delete a value that isn't a list
+void lval_del_node(lval* v) {
+	switch (v->type) {
+		case LVAL_ERR: free(v->err); break;
+		case LVAL_SYM: free(v->sym); break;
+		case LVAL_BIG: free(v->limbs); break;
+		case LVAL_THUNK:
+			if (v->thunk->code) { lval_del(v->thunk->code); }
+			break;
+		case LVAL_FUN:
+			if (v->closure && --v->closure->refs == 0) {
+				lclosure_del(v->closure);
+			}
+			if (v->memo && --v->memo->refs == 0) {
+				lmemo_del(v->memo);
+			}
+			break;
+	}
+	free(v);
+}
+
+//cleanup, a shared literal only once nothing holds it
+void lval_del(lval* v) {
+	if (v->refs && --v->refs) { return; }
+	if (v->type != LVAL_QEXPR && v->type != LVAL_SEXPR) {
+		lval_del_node(v);
+		return;
+	}
+
+	//delete lists off a work stack, everything else right away
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+
+	while (s.count) {
+		lval* x = s.items[--s.count].v;
+		for (int i = 0; i < x->count; i++) {
+			lval* y = x->cell[i];
+			if (y->refs && --y->refs) { continue; }
+			if (y->type == LVAL_QEXPR || y->type == LVAL_SEXPR) {
+				lstack_push(&s, y, NULL, NULL, 0);
+			} else {
+				lval_del_node(y);
+			}
+		}
+		free(x->cell);
+		free(x);
+	}
+	lstack_del(&s);
+}
+
+void lstack_init(lstack* s) {
+	s->count = 0;
+	s->cap = LSTACK_LOCAL;
+	s->items = s->local;
+}
+
+void lstack_push(lstack* s, lval* v, lval* x, mpc_ast_t* t, int i) {
+	//spill to the heap once the local buffer is full
+	if (s->count == s->cap) {
+		s->cap *= 2;
+		if (s->items == s->local) {
+			s->items = malloc(sizeof(lwork) * s->cap);
+			memcpy(s->items, s->local, sizeof(lwork) * s->count);
+		} else {
+			s->items = realloc(s->items, sizeof(lwork) * s->cap);
+		}
+	}
+	lwork* w = &s->items[s->count++];
+	w->v = v;
+	w->x = x;
+	w->t = t;
+	w->i = i;
+}
+
+void lstack_del(lstack* s) {
+	if (s->items != s->local) { free(s->items); }
+}
+
+lenv* lenv_new(void) {
+	lenv* e = malloc(sizeof(lenv));
+	e->version = 0;
+	e->count = 0;
+	e->syms = NULL;
+	e->vals = NULL;
+	e->fn = NULL;
+	e->frame = NULL;
+	e->frame_count = 0;
+	e->tail = NULL;
+	return e;
+}
+
+lval* lenv_get(lenv* e, lval* k) {
+	//return a copy of value, if the symbol matches a stored string
+	lval* v = lenv_lookup(e, k);
+	if (v) { return lval_copy(v); }
+
+	//if no symbol is found, return error
+	return lval_err("Unbound symbol!");
+}
+
+//find the value bound to a symbol without copying it, NULL if unbound.
+//symbols in a lambda body may index its frame instead, where a lazy
+//argument is forced the first time it is looked up. Otherwise the
+//symbol's inline cache is used while nothing has been defined
+//since it was filled, and refilled otherwise
+lval* lenv_lookup(lenv* e, lval* k) {
+	if (k->local != -1 && k->local < e->frame_count) {
+		lval* x = e->frame[k->local];
+		if (x && x->type == LVAL_THUNK) { lval_force(e, x); }
+		return x;
+	}
+	if (k->version == e->version) {
+		ic_hits++;
+		return e->vals[k->slot];
+	}
+
+	ic_misses++;
+	k->slot = lenv_slot(e, k);
+	if (k->slot == -1) { return NULL; }
+	k->version = e->version;
+	return e->vals[k->slot];
+}
+
+//index of a symbol in the environment, -1 if unbound
+int lenv_slot(lenv* e, lval* k) {
+	//iterate over all items in environment
+	for (int i = 0; i < e->count; i++) {
+		if (strcmp(e->syms[i], k->sym) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void lenv_put(lenv* e, lval* k, lval* v) {
+	e->version++;
+
+	//iterate over all items in environment
+	for (int i = 0; i< e->count; i++) {
+		//if variable is found delete item at position
+		//and replace with new variable
+		if (strcmp(e->syms[i], k->sym) == 0) {
+			lval_del(e->vals[i]);
+			e->vals[i] = lval_copy(v);
+			return;
+		}
+	}
+
+	//if variable does not already exist, make space for a new variable
+	e->count++;
+	e->vals = realloc(e->vals, sizeof(lval*) * e->count);
+	e->syms = realloc(e->syms, sizeof(char*) * e->count);
+
+	//copy contents of lval and symbol string into new location
+	e->vals[e->count-1] = lval_copy(v);
+	e->syms[e->count-1] = malloc(strlen(k->sym)+1);
+	strcpy(e->syms[e->count-1], k->sym);
+}
+
+//bind a number, reusing the lval already bound when it is a number so
+//loop variables and counters don't allocate. The binding stays in its
+//slot, so inline caches don't need invalidating
+void lenv_put_num(lenv* e, lval* k, long x) {
+	lval* v = lenv_lookup(e, k);
+	if (v && v->type == LVAL_NUM && v->refs == 0) {
+		v->num = x;
+		return;
+	}
+	v = lval_num(x);
+	lenv_put(e, k, v);
+	lval_del(v);
+}
+
+void lenv_del(lenv* e) {
+	for (int i = 0; i< e->count; i++) {
+		free(e->syms[i]);
+		lval_del(e->vals[i]);
+	}
+	free(e->syms);
+	free(e->vals);
+	free(e);
+}
+
+void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
+	lval* k = lval_sym(name);
+	lval* v = lval_fun(func);
+	lenv_put(e, k, v);
+	lval_del(k);
+	lval_del(v);
+}
+
+void lenv_add_builtins(lenv* e) {
+	//list functions
+	lenv_add_builtin(e, "list", builtin_list);
+	lenv_add_builtin(e, "head", builtin_head);
+	lenv_add_builtin(e, "tail", builtin_tail);
+	lenv_add_builtin(e, "eval", builtin_eval);
+	lenv_add_builtin(e, "eval-stats", builtin_eval_stats);
+	lenv_add_builtin(e, "join", builtin_join);
+
+	//mathematical functions
+	lenv_add_builtin(e, "+", builtin_add);
+	lenv_add_builtin(e, "-", builtin_sub);
+	lenv_add_builtin(e, "*", builtin_mul);
+	lenv_add_builtin(e, "/", builtin_div);
+
+	//comparison functions
+	lenv_add_builtin(e, ">",  builtin_gt);
+	lenv_add_builtin(e, "<",  builtin_lt);
+	lenv_add_builtin(e, ">=", builtin_ge);
+	lenv_add_builtin(e, "<=", builtin_le);
+	lenv_add_builtin(e, "==", builtin_eq);
+	lenv_add_builtin(e, "!=", builtin_ne);
+
+	//special forms
+	lenv_add_builtin(e, "if", builtin_if);
+	lenv_add_builtin(e, "and", builtin_and);
+	lenv_add_builtin(e, "or", builtin_or);
+	lenv_add_builtin(e, "while", builtin_while);
+	lenv_add_builtin(e, "dotimes", builtin_dotimes);
+	lenv_add_builtin(e, "foreach", builtin_foreach);
+	lenv_add_builtin(e, "\\", builtin_lambda);
+	lenv_add_builtin(e, "let", builtin_let);
+
+	//variable functions
+	lenv_add_builtin(e, "def", builtin_def);
+	lenv_add_builtin(e, "specialize", builtin_specialize);
+	lenv_add_builtin(e, "memo", builtin_memo);
+	lenv_add_builtin(e, "memo-stats", builtin_memo_stats);
+	lenv_add_builtin(e, "defmacro", builtin_defmacro);
+	lenv_add_builtin(e, "macro-stats", builtin_macro_stats);
+	lenv_add_builtin(e, "bench", builtin_bench);
+	lenv_add_builtin(e, "jit", builtin_jit);
+	lenv_add_builtin(e, "ic", builtin_ic);
+	lenv_add_builtin(e, "print", builtin_print);
+}
+
+lchunk* lchunk_new(void) {
+	lchunk* c = malloc(sizeof(lchunk));
+	c->count = 0;
+	c->code = NULL;
+	c->loops_count = 0;
+	c->loops = NULL;
+	c->thunks_count = 0;
+	c->thunks = NULL;
+	c->jits_count = 0;
+	c->jits = NULL;
+	c->region_depth = 0;
+	c->nums_count = 0;
+	c->nums = NULL;
+	c->consts_count = 0;
+	c->consts = NULL;
+	c->depth = 0;
+	c->temps = 0;
+	c->cses_count = 0;
+	c->cses = NULL;
+	c->lazy = 0;
+	return c;
+}
+
+void lchunk_del(lchunk* c) {
+	for (int i = 0; i < c->loops_count; i++) {
+		if (c->loops[i].sym) { lval_del(c->loops[i].sym); }
+		if (c->loops[i].cond) { lchunk_del(c->loops[i].cond); }
+		lchunk_del(c->loops[i].body);
+	}
+	free(c->loops);
+	for (int i = 0; i < c->thunks_count; i++) {
+		lchunk_del(c->thunks[i]);
+	}
+	free(c->thunks);
+	for (int i = 0; i < c->jits_count; i++) {
+		ljit_del(&c->jits[i]);
+	}
+	free(c->jits);
+	for (int i = 0; i < c->consts_count; i++) {
+		lval_del(c->consts[i]);
+	}
+	free(c->consts);
+	free(c->nums);
+	free(c->code);
+	free(c);
+}
+
+void lchunk_emit(lchunk* c, int op, int arg) {
+	c->count += 2;
+	c->code = realloc(c->code, sizeof(int) * c->count);
+	c->code[c->count-2] = op;
+	c->code[c->count-1] = arg;
+}
+
+//add chunk t for a lazy argument and return its index
+int lchunk_thunk(lchunk* c, lchunk* t) {
+	c->thunks_count++;
+	c->thunks = realloc(c->thunks, sizeof(lchunk*) * c->thunks_count);
+	c->thunks[c->thunks_count-1] = t;
+	return c->thunks_count-1;
+}
+
+//add a copy of v to the constant pool and return its index
+int lchunk_const(lchunk* c, lval* v) {
+	c->consts_count++;
+	c->consts = realloc(c->consts, sizeof(lval*) * c->consts_count);
+	c->consts[c->consts_count-1] = lval_copy(v);
+	return c->consts_count-1;
+}
+
+//compile an expression to bytecode, v is left untouched so the
+//chunk can be run any number of times
+lchunk* lval_compile(lenv* e, lval* v) {
+	lchunk* c = lchunk_new();
+	if (lval_compile_deep(c, v, 0)) { return c; }
+	lval_cse(c, e, v);
+	lval_compile_expr(c, e, v, 0);
+	free(c->cses);
+	c->cses = NULL;
+	c->cses_count = 0;
+	return c;
+}
+
+//emit code that leaves the value of v on top of the stack, sp is
+//the stack depth before it runs. e is only used to recognise special
+//forms, which have to be bound when the chunk is compiled
+void lval_compile_expr(lchunk* c, lenv* e, lval* v, int sp) {
+	if (sp + 1 > c->depth) { c->depth = sp + 1; }
+
+	switch (v->type) {
+		case LVAL_NUM:
+			c->nums_count++;
+			c->nums = realloc(c->nums, sizeof(long) * c->nums_count);
+			c->nums[c->nums_count-1] = v->num;
+			lchunk_emit(c, OP_NUM, c->nums_count-1);
+			return;
+
+		case LVAL_SYM:
+			lchunk_emit(c, OP_SYM, lchunk_const(c, v));
+			return;
+
+		case LVAL_SEXPR:
+			//empty expressions evaluate to themselves and a single
+			//expression to the value of its only child
+			if (v->count == 0) { break; }
+			if (v->count == 1) {
+				lval_compile_expr(c, e, v->cell[0], sp);
+				return;
+			}
+			//a repeated pure application is computed the first time and
+			//loaded after that
+			int k = c->cses_count ? lchunk_cse(c, v, lval_hash(v)) : -1;
+			if (k != -1) { c->cses[k].count--; }
+			if (k != -1 && c->cses[k].stored) {
+				lchunk_emit(c, c->cses[k].count ? OP_LOAD : OP_TAKE, k);
+				return;
+			}
+			if (lval_compile_special(c, e, v, sp)) { return; }
+
+			//eval of code written in place is compiled along with it, and
+			//of code bound to a global runs it without copying it
+			if (lval_head(e, v) == builtin_eval && v->count == 2) {
+				lval* x = v->cell[1];
+				if (x->type == LVAL_QEXPR) {
+					lval_compile_branch(c, e, x, sp);
+					return;
+				}
+				if (x->type == LVAL_SYM && x->local == -1) {
+					lchunk_emit(c, OP_EVAL, lchunk_const(c, x));
+					return;
+				}
+			}
+
+			//outermost arithmetic regions are marked for the jit, the
+			//ordinary code after the mark runs until they are hot. The
+			//native code skips that, so it can't store temporaries
+			int j = -1;
+			if (c->region_depth == 0 && jit_region(v)
+				&& !(c->cses_count && lchunk_cse_inside(c, v))) {
+				j = ljit_add(c, v);
+				lchunk_emit(c, OP_JIT, j);
+			}
+			c->region_depth += (j != -1);
+
+			//push the function then its arguments, left to right. A
+			//symbol at the head is only called, so a builtin it names
+			//is pushed without copying it. A global bound to a lazy
+			//lambda gets thunks for its lazy arguments
+			int head = v->cell[0]->type == LVAL_SYM;
+			int slot = head && v->cell[0]->local == -1 ? lenv_slot(e, v->cell[0]) : -1;
+			lval* g = slot != -1 ? e->vals[slot] : NULL;
+			int lazy = g && lval_lazy(g);
+			if (head) { lchunk_emit(c, OP_FUN, lchunk_const(c, v->cell[0])); }
+			for (int i = head; i < v->count; i++) {
+				lval* x = v->cell[i];
+				if (lazy && lval_lazy_arg(g, i-1)
+					&& (x->type == LVAL_SEXPR || x->type == LVAL_SYM)) {
+					if (sp + i + 1 > c->depth) { c->depth = sp + i + 1; }
+					lchunk_emit(c, OP_THUNK, lchunk_thunk(c, lval_compile_code(e, x)));
+					continue;
+				}
+				lval_compile_expr(c, e, x, sp + i);
+			}
+			lchunk_emit(c, lazy ? OP_CALLT : head ? OP_CALLF : OP_CALL, v->count-1);
+
+			if (j != -1) {
+				c->region_depth--;
+				c->jits[j].end = c->count;
+			}
+			if (k != -1 && c->lazy == 0 && c->region_depth == 0) {
+				lchunk_emit(c, OP_STORE, k);
+				c->cses[k].stored = 1;
+			}
+			return;
+	}
+
+	//everything else is a constant which is copied when pushed
+	lchunk_emit(c, OP_CONST, lchunk_const(c, v));
+}
+
+//if, and and or compile to jumps so only the arguments they need are
+//run and a let in a lambda sets its frame slots, def and anything
+//malformed is left to the tree walker. 0 is returned if v isn't a
+//special form
+int lval_compile_special(lchunk* c, lenv* e, lval* v, int sp) {
+	lval* f = v->cell[0]->type == LVAL_SYM && v->cell[0]->local == -1
+		? lenv_lookup(e, v->cell[0]) : NULL;
+	if (f && lval_macro(f)) {
+		lchunk_emit(c, OP_TREE, lchunk_const(c, v));
+		return 1;
+	}
+	if (f == NULL || f->type != LVAL_FUN || !lval_special(f->fun)) { return 0; }
+
+	if (lval_compile_loop(c, e, f->fun, v, sp)) { return 1; }
+	if (f->fun == builtin_let && lval_let_form(v) && v->cell[1]->count
+		&& v->cell[1]->cell[0]->local != -1) {
+		//value, OP_BIND slot, OP_JUMP end for each name, body, then
+		//end: OP_UNBIND for each name. A bind skips the jump after it
+		//unless the value is an error
+		lval* b = v->cell[1];
+		int* jumps = malloc(sizeof(int) * b->count);
+		for (int i = 0; i < b->count; i += 2) {
+			lval_compile_expr(c, e, b->cell[i+1], sp);
+			lchunk_emit(c, OP_BIND, b->cell[i]->local);
+			jumps[i] = c->count;
+			lchunk_emit(c, OP_JUMP, 0);
+		}
+		lval_compile_branch(c, e, v->cell[2], sp);
+		for (int i = 0; i < b->count; i += 2) {
+			c->code[jumps[i]+1] = c->count;
+		}
+		for (int i = 0; i < b->count; i += 2) {
+			lchunk_emit(c, OP_UNBIND, b->cell[i]->local);
+		}
+		free(jumps);
+		return 1;
+	}
+	int lazy = f->fun == builtin_if || f->fun == builtin_and || f->fun == builtin_or;
+	if (!lazy || (f->fun == builtin_if && v->count != 3 && v->count != 4)) {
+		lchunk_emit(c, OP_TREE, lchunk_const(c, v));
+		return 1;
+	}
+
+	if (f->fun == builtin_if) {
+		//cond, OP_IF else, then, OP_JUMP end, else
+		lval_compile_expr(c, e, v->cell[1], sp);
+		int test = c->count;
+		lchunk_emit(c, OP_IF, 0);
+		c->lazy++;
+		lval_compile_branch(c, e, v->cell[2], sp);
+		int jump = c->count;
+		lchunk_emit(c, OP_JUMP, 0);
+		c->code[test+1] = c->count;
+		if (v->count == 4) {
+			lval_compile_branch(c, e, v->cell[3], sp);
+		} else {
+			lval* x = lval_sexpr();
+			lval_compile_expr(c, e, x, sp);
+			lval_del(x);
+		}
+		c->lazy--;
+		c->code[jump+1] = c->count;
+		return 1;
+	}
+
+	if (f->fun == builtin_and || f->fun == builtin_or) {
+		//every argument is followed by a test that jumps to the end
+		//once the result is known, if none does the default is pushed
+		int op = f->fun == builtin_and ? OP_AND : OP_OR;
+		int* tests = malloc(sizeof(int) * v->count);
+		for (int i = 1; i < v->count; i++) {
+			if (i == 2) { c->lazy++; }
+			lval_compile_expr(c, e, v->cell[i], sp);
+			tests[i] = c->count;
+			lchunk_emit(c, op, 0);
+		}
+		if (v->count > 2) { c->lazy--; }
+		lval* x = lval_num(op == OP_AND);
+		lval_compile_expr(c, e, x, sp);
+		lval_del(x);
+		for (int i = 1; i < v->count; i++) {
+			c->code[tests[i]+1] = c->count;
+		}
+		free(tests);
+		return 1;
+	}
+	return 0;
+}
+
+//def of a literal list of names, while, and loops whose variable is
+//given literally get their own instructions, 0 is returned for
+//anything else
+int lval_compile_loop(lchunk* c, lenv* e, lbuiltin f, lval* v, int sp) {
+	//def, dotimes and foreach take a literal list of names, the first
+	//argument of while is its condition instead
+	lval* syms = v->cell[1];
+	int literal = syms->type == LVAL_QEXPR;
+	for (int i = 0; literal && i < syms->count; i++) {
+		literal = syms->cell[i]->type == LVAL_SYM;
+	}
+
+	//push the values, then bind them all at once
+	if (f == builtin_def) {
+		if (!literal || syms->count != v->count-2) { return 0; }
+		for (int i = 2; i < v->count; i++) {
+			lval_compile_expr(c, e, v->cell[i], sp + i-2);
+		}
+		lchunk_emit(c, OP_DEF, lchunk_const(c, syms));
+		return 1;
+	}
+
+	int op = f == builtin_while ? OP_WHILE
+		: f == builtin_dotimes ? OP_DOTIMES
+		: f == builtin_foreach ? OP_FOREACH : -1;
+	if (op == -1 || v->count != (op == OP_WHILE ? 3 : 4)) { return 0; }
+	if (op != OP_WHILE && (!literal || syms->count != 1)) { return 0; }
+
+	c->loops_count++;
+	c->loops = realloc(c->loops, sizeof(lloop) * c->loops_count);
+	lloop* l = &c->loops[c->loops_count-1];
+	if (op == OP_WHILE) {
+		l->sym = NULL;
+		l->cond = lval_compile_code(e, v->cell[1]);
+		l->body = lval_compile_code(e, v->cell[2]);
+	} else {
+		//the count or list is pushed for the loop instruction to take
+		l->sym = lval_copy(syms->cell[0]);
+		l->cond = NULL;
+		l->body = lval_compile_code(e, v->cell[3]);
+		lval_compile_expr(c, e, v->cell[2], sp);
+	}
+	lchunk_emit(c, op, c->loops_count-1);
+	return 1;
+}
+
+//compile code on its own, a Q-expression is compiled as the code it
+//holds
+lchunk* lval_compile_code(lenv* e, lval* v) {
+	lchunk* c = lchunk_new();
+	if (lval_compile_deep(c, v, 1)) { return c; }
+	lval_cse(c, e, v);
+	lval_compile_branch(c, e, v, 0);
+	free(c->cses);
+	c->cses = NULL;
+	c->cses_count = 0;
+	return c;
+}
+
+//code nested too deep for the compiler, which recurses on the C stack,
+//is left to the tree walker. 0 is returned if v isn't
+int lval_compile_deep(lchunk* c, lval* v, int code) {
+	if (!lval_deep(v)) { return 0; }
+	lval* x = lval_thaw(lval_copy(v));
+	if (code && x->type == LVAL_QEXPR) { x->type = LVAL_SEXPR; }
+	c->depth = 1;
+	lchunk_emit(c, OP_TREE, lchunk_const(c, x));
+	lval_del(x);
+	return 1;
+}
+
+//calls in the chunk for a lambda body that only jumps to the end
+//follow are tail calls, made by lval_call_args in place of the call
+//of the lambda
+void lchunk_tail(lchunk* c) {
+	for (int pc = 0; pc < c->count; pc += 2) {
+		if (c->code[pc] != OP_CALL && c->code[pc] != OP_CALLF) { continue; }
+		int next = pc + 2;
+		while (next < c->count && c->code[next] == OP_JUMP) { next = c->code[next+1]; }
+		if (next < c->count) { continue; }
+		c->code[pc] = c->code[pc] == OP_CALL ? OP_TAIL : OP_TAILF;
+	}
+}
+
+//a branch of if, Q-expressions are compiled as the code they hold
+void lval_compile_branch(lchunk* c, lenv* e, lval* v, int sp) {
+	if (v->type != LVAL_QEXPR) {
+		lval_compile_expr(c, e, v, sp);
+		return;
+	}
+	lval* x = lval_thaw(lval_copy(v));
+	x->type = LVAL_SEXPR;
+	lval_compile_expr(c, e, x, sp);
+	lval_del(x);
+}
+
+//the builtin a list applies when its head is a global name for one,
+//NULL otherwise
+lbuiltin lval_head(lenv* e, lval* v) {
+	if ((v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) || v->count == 0) {
+		return NULL;
+	}
+	lval* k = v->cell[0];
+	if (k->type != LVAL_SYM || k->local != -1) { return NULL; }
+	int i = lenv_slot(e, k);
+	return i != -1 && e->vals[i]->type == LVAL_FUN ? e->vals[i]->fun : NULL;
+}
+
+//structural hash, values that are lval_eq hash the same
+unsigned long lval_hash(lval* v) {
+	unsigned long h = 14695981039346656037UL;
+
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+	while (s.count) {
+		lval* x = s.items[--s.count].v;
+		unsigned long k = x->type;
+		switch (x->type) {
+			case LVAL_NUM: k ^= (unsigned long)x->num << 3; break;
+			case LVAL_BIG:
+				for (int i = 0; i < x->limbs_count; i++) {
+					k = (k ^ x->limbs[i]) * 1099511628211UL;
+				}
+				k ^= (unsigned long)x->num << 3;
+				break;
+			case LVAL_DBL: {
+				//0.0 and -0.0 are equal so they have to hash the same
+				double d = x->dbl == 0 ? 0 : x->dbl;
+				unsigned long b;
+				memcpy(&b, &d, sizeof(b));
+				k ^= b;
+				break;
+			}
+			case LVAL_ERR:
+			case LVAL_SYM: {
+				char* c = x->type == LVAL_SYM ? x->sym : x->err;
+				while (*c) { k = (k ^ (unsigned char)*c++) * 1099511628211UL; }
+				break;
+			}
+			case LVAL_FUN:
+				k ^= (unsigned long)(size_t)x->fun ^ (unsigned long)(size_t)x->closure
+					^ (unsigned long)(size_t)x->memo;
+				break;
+			case LVAL_SEXPR:
+			case LVAL_QEXPR:
+				k ^= (unsigned long)x->count << 3;
+				for (int i = 0; i < x->count; i++) {
+					lstack_push(&s, x->cell[i], NULL, NULL, 0);
+				}
+				break;
+		}
+		h = (h ^ k) * 1099511628211UL;
+	}
+	lstack_del(&s);
+	return h;
+}
+
+//can nothing in code v change a binding while it runs: no calls of
+//lambdas, def, eval or bench, no loops and no lets. A def at the top
+//only binds once its values are computed, so only they count
+int lval_stable(lenv* e, lval* v) {
+	int def = lval_head(e, v) == builtin_def;
+	if (!def && lval_opaque(e, NULL, v)) { return 0; }
+	for (int i = 2; def && i < v->count; i++) {
+		if (lval_opaque(e, NULL, v->cell[i])) { return 0; }
+	}
+
+	int ok = 1;
+	lstack s;
+	lstack_init(&s);
+	lstack_push(&s, v, NULL, NULL, 0);
+	while (s.count && ok) {
+		lval* x = s.items[--s.count].v;
+		if (x->type == LVAL_SEXPR || x->type == LVAL_QEXPR) {
+			for (int i = 0; i < x->count; i++) {
+				lstack_push(&s, x->cell[i], NULL, NULL, 0);
+			}
+		}
+		if (x->type == LVAL_SYM && x->local == -1) {
+			int k = lenv_slot(e, x);
+			lbuiltin f = k != -1 && e->vals[k]->type == LVAL_FUN ? e->vals[k]->fun : NULL;
+			ok = f != builtin_while && f != builtin_dotimes && f != builtin_foreach
+				&& f != builtin_let;
+		}
+	}
+	lstack_del(&s);
+	return ok;
+}
+
+//an application of +, -, *, /, head, tail or list to numbers, symbols,
+//Q-expressions or more such applications
+int lval_cse_pure(lenv* e, lval* v) {
+	if (v->type != LVAL_SEXPR || v->count < 2) { return 0; }
+	lbuiltin f = lval_head(e, v);
+	int op = vm_op(f);
+	if ((op == -1 || op > LOP_DIV) && f != builtin_head && f != builtin_tail
+		&& f != builtin_list) { return 0; }
+
+	for (int i = 1; i < v->count; i++) {
+		lval* x = v->cell[i];
+		if (x->type == LVAL_SEXPR && !lval_cse_pure(e, x)) { return 0; }
+		if (x->type != LVAL_SEXPR && x->type != LVAL_NUM && x->type != LVAL_SYM
+			&& x->type != LVAL_QEXPR) { return 0; }
+	}
+	return 1;
+}
+
+//find the pure applications code v computes more than once, when
+//nothing can change what they evaluate to in between
+void lval_cse(lchunk* c, lenv* e, lval* v) {
+	if (!lval_stable(e, v)) { return; }
+	lval_cse_scan(c, e, v);
+
+	int n = 0;
+	for (int i = 0; i < c->cses_count; i++) {
+		if (c->cses[i].count > 1) { c->cses[n++] = c->cses[i]; }
+	}
+	c->cses_count = n;
+	c->temps = n;
+}
+
+//count the pure applications in v, in what the chunk compiles itself.
+//Q-expressions are data unless they are branches of if
+void lval_cse_scan(lchunk* c, lenv* e, lval* v) {
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return; }
+	lbuiltin f = lval_head(e, v);
+	if (f == builtin_lambda) { return; }
+
+	if (lval_cse_pure(e, v)) {
+		unsigned long h = lval_hash(v);
+		int k = lchunk_cse(c, v, h);
+		if (k != -1) {
+			c->cses[k].count++;
+		} else {
+			c->cses_count++;
+			c->cses = realloc(c->cses, sizeof(lcse) * c->cses_count);
+			lcse x = { h, v, 1, 0 };
+			c->cses[c->cses_count-1] = x;
+		}
+	}
+	for (int i = 0; i < v->count; i++) {
+		if (v->cell[i]->type == LVAL_QEXPR && (f != builtin_if || i < 2)) { continue; }
+		lval_cse_scan(c, e, v->cell[i]);
+	}
+}
+
+//index of the common subexpression v with hash h, -1 if it isn't one
+int lchunk_cse(lchunk* c, lval* v, unsigned long h) {
+	for (int i = 0; i < c->cses_count; i++) {
+		if (c->cses[i].hash == h && lval_eq(c->cses[i].v, v)) { return i; }
+	}
+	return -1;
+}
+
+//is there a common subexpression anywhere inside v
+int lchunk_cse_inside(lchunk* c, lval* v) {
+	for (int i = 0; i < v->count; i++) {
+		lval* x = v->cell[i];
+		if (x->type != LVAL_SEXPR) { continue; }
+		if (lchunk_cse(c, x, lval_hash(x)) != -1 || lchunk_cse_inside(c, x)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+//turn a stack slot back into an lval
+lval* vslot_box(vslot s) {
+	return s.v ? s.v : lval_num(s.num);
+}
+
+//the arithmetic or comparison operator a builtin applies, -1 for
+//anything else
+int vm_op(lbuiltin f) {
+	if (f == builtin_add) { return LOP_ADD; }
+	if (f == builtin_sub) { return LOP_SUB; }
+	if (f == builtin_mul) { return LOP_MUL; }
+	if (f == builtin_div) { return LOP_DIV; }
+	if (f == builtin_gt) { return LOP_GT; }
+	if (f == builtin_lt) { return LOP_LT; }
+	if (f == builtin_ge) { return LOP_GE; }
+	if (f == builtin_le) { return LOP_LE; }
+	if (f == builtin_eq) { return LOP_EQ; }
+	if (f == builtin_ne) { return LOP_NE; }
+	return -1;
+}
+
+//arithmetic directly on unboxed numbers into r, mirrors builtin_op. 0
+//is returned if the result would overflow, for builtin_op to redo
+int vm_arith(int op, vslot* a, int count, vslot* r) {
+	r->v = NULL;
+	r->num = a[0].num;
+	long t;
+
+	switch (op) {
+		case LOP_ADD:
+			for (int i = 1; i < count; i++) {
+				if (__builtin_add_overflow(r->num, a[i].num, &t)) { return 0; }
+				r->num = t;
+			}
+			break;
+
+		case LOP_SUB:
+			//if no arguments and sub, then perform unary negation
+			if (count == 1) {
+				if (r->num == LONG_MIN) { return 0; }
+				r->num = -r->num;
+			}
+			for (int i = 1; i < count; i++) {
+				if (__builtin_sub_overflow(r->num, a[i].num, &t)) { return 0; }
+				r->num = t;
+			}
+			break;
+
+		case LOP_MUL:
+			for (int i = 1; i < count; i++) {
+				if (__builtin_mul_overflow(r->num, a[i].num, &t)) { return 0; }
+				r->num = t;
+			}
+			break;
+
+		case LOP_DIV:
+			for (int i = 1; i < count; i++) {
+				if (a[i].num == 0) {
+					r->v = lval_err("Division By Zero!");
+					break;
+				}
+				if (a[i].num == -1 && r->num == LONG_MIN) { return 0; }
+				r->num /= a[i].num;
+			}
+			break;
+
+		//comparisons only get here with exactly two arguments
+		case LOP_GT: r->num = a[0].num >  a[1].num; break;
+		case LOP_LT: r->num = a[0].num <  a[1].num; break;
+		case LOP_GE: r->num = a[0].num >= a[1].num; break;
+		case LOP_LE: r->num = a[0].num <= a[1].num; break;
+		case LOP_EQ: r->num = a[0].num == a[1].num; break;
+		case LOP_NE: r->num = a[0].num != a[1].num; break;
+	}
+	return 1;
+}
+
+//apply s[0] to the count values following it, consuming all of them.
+//A builtin head pushed by OP_FUN is in fun, with v NULL
+vslot vm_call(lenv* e, vslot* s, int count) {
+	vslot r = { NULL, 0 };
+
+	//the first error wins, as in lval_apply
+	for (int i = 0; i <= count; i++) {
+		if (s[i].v && s[i].v->type == LVAL_ERR) {
+			r = s[i];
+			for (int j = 0; j <= count; j++) {
+				if (j != i && s[j].v) { lval_del(s[j].v); }
+			}
+			return r;
+		}
+	}
+
+	lval* f = s[0].v;
+	if (f ? f->type != LVAL_FUN : s[0].fun == NULL) {
+		for (int i = 0; i <= count; i++) {
+			if (s[i].v) { lval_del(s[i].v); }
+		}
+		r.v = lval_err("First element is not a function");
+		return r;
+	}
+	lbuiltin fun = f ? f->fun : s[0].fun;
+
+	//arithmetic and comparisons on unboxed numbers never touch the heap
+	int op = vm_op(fun);
+	if (op != -1 && (op <= LOP_DIV || count == 2)) {
+		int unboxed = 1;
+		for (int i = 1; i <= count; i++) {
+			if (s[i].v) { unboxed = 0; break; }
+		}
+		if (unboxed && vm_arith(op, &s[1], count, &r)) {
+			if (f) { lval_del(f); }
+			return r;
+		}
+	}
+
+	//otherwise box the arguments and call the builtin or lambda. The
+	//arguments of a lambda go straight into its frame
+	lval* x;
+	if (f && f->closure && count <= VM_LOCAL) {
+		lval* args[VM_LOCAL];
+		for (int i = 1; i <= count; i++) { args[i-1] = vslot_box(s[i]); }
+		allocs_avoided++;
+		x = lval_call_args(e, f, args, count);
+	} else {
+		lval* a = lval_sexpr();
+		for (int i = 1; i <= count; i++) {
+			lval_add(a, vslot_box(s[i]));
+		}
+		x = f ? lval_invoke(e, f, a) : fun(e, a);
+		if (lval_special(fun)) { x = lval_eval(e, x); }
+	}
+	if (f) { lval_del(f); }
+
+	//keep numbers unboxed on the stack
+	if (x->type == LVAL_NUM) {
+		r.num = x->num;
+		lval_del(x);
+	} else {
+		r.v = x;
+	}
+	return r;
+}
+
+//leave the call of s[0] on the count values after it in e->tail for
+//lval_call_args to make, if it can be made once this frame is gone.
+//0 is returned, with the stack untouched, if it can't
+int vm_tail(lenv* e, vslot* s, int count) {
+	if (s[0].v == NULL || !lval_tail(s[0].v)) { return 0; }
+	for (int i = 1; i <= count; i++) {
+		if (s[i].v && (s[i].v->type == LVAL_ERR || s[i].v->type == LVAL_THUNK)) { return 0; }
+	}
+	lval* t = lval_sexpr();
+	for (int i = 0; i <= count; i++) { lval_add(t, vslot_box(s[i])); }
+	e->tail = t;
+	return 1;
+}
+
+//bind the values s[0..] to syms like def, the first error wins
+vslot vm_def(lenv* e, lval* syms, vslot* s) {
+	vslot r = { NULL, 0 };
+	for (int i = 0; i < syms->count; i++) {
+		if (s[i].v && s[i].v->type == LVAL_ERR && r.v == NULL) {
+			r.v = s[i].v;
+			s[i].v = NULL;
+		}
+	}
+
+	for (int i = 0; i < syms->count; i++) {
+		if (r.v == NULL && s[i].v == NULL) {
+			lenv_put_num(e, syms->cell[i], s[i].num);
+		} else if (r.v == NULL) {
+			lenv_put(e, syms->cell[i], s[i].v);
+		}
+		if (s[i].v) { lval_del(s[i].v); }
+	}
+
+	if (r.v == NULL) { r.v = lval_sexpr(); }
+	return r;
+}
+
+lval* lchunk_run(lenv* e, lchunk* c) {
+	return vslot_box(lchunk_value(e, c));
+}
+
+//run a chunk, small operand stacks live on the C stack
+vslot lchunk_value(lenv* e, lchunk* c) {
+	//temporaries live above the operand stack
+	vslot local[VM_LOCAL];
+	int size = c->depth + c->temps;
+	vslot* stack = size <= VM_LOCAL ? local : malloc(sizeof(vslot) * size);
+	vslot* temps = stack + c->depth;
+	for (int i = 0; i < c->temps; i++) { temps[i].v = NULL; }
+	int sp = 0;
+
+	for (int pc = 0; pc < c->count; pc += 2) {
+		int arg = c->code[pc+1];
+		switch (c->code[pc]) {
+			case OP_NUM:
+				stack[sp].v = NULL;
+				stack[sp].num = c->nums[arg];
+				sp++;
+				break;
+
+			case OP_CONST:
+				stack[sp].v = lval_copy(c->consts[arg]);
+				sp++;
+				break;
+
+			case OP_SYM: {
+				//numbers are read straight out of the environment, the
+				//constant keeps its inline cache between runs
+				lval* x = lenv_lookup(e, c->consts[arg]);
+				if (x && x->type == LVAL_NUM) {
+					stack[sp].v = NULL;
+					stack[sp].num = x->num;
+				} else {
+					stack[sp].v = x ? lval_copy(x) : lval_err("Unbound symbol!");
+				}
+				sp++;
+				break;
+			}
+
+			case OP_FUN: {
+				//a builtin goes in fun, anything else is pushed as by OP_SYM
+				lval* x = lenv_lookup(e, c->consts[arg]);
+				stack[sp].fun = NULL;
+				if (x && x->type == LVAL_FUN && x->fun) {
+					stack[sp].v = NULL;
+					stack[sp].fun = x->fun;
+					allocs_avoided++;
+				} else {
+					stack[sp].v = x ? lval_copy(x) : lval_err("Unbound symbol!");
+				}
+				sp++;
+				break;
+			}
+
+			case OP_CALL:
+			case OP_CALLF:
+			case OP_TAIL:
+			case OP_TAILF:
+				sp -= arg + 1;
+				if (c->code[pc] == OP_CALL || c->code[pc] == OP_TAIL) { stack[sp].fun = NULL; }
+				//only jumps to the end follow a tail call, which leave
+				//the placeholder pushed for it as the chunk's value
+				if ((c->code[pc] == OP_TAIL || c->code[pc] == OP_TAILF)
+					&& vm_tail(e, &stack[sp], arg)) {
+					stack[sp].v = NULL;
+					stack[sp].num = 0;
+				} else {
+					stack[sp] = vm_call(e, &stack[sp], arg);
+				}
+				sp++;
+				break;
+
+			case OP_THUNK:
+				stack[sp].v = lval_thunk(e, NULL, c->thunks[arg]);
+				sp++;
+				break;
+
+			case OP_CALLT:
+				//the head may have been redefined since, whatever it
+				//doesn't take lazily is forced before the call
+				sp -= arg + 1;
+				for (int i = 1; i <= arg; i++) {
+					lval* x = stack[sp+i].v;
+					if (x && x->type == LVAL_THUNK
+						&& !(stack[sp].v && lval_lazy_arg(stack[sp].v, i-1))) {
+						lval_force(e, x);
+					}
+				}
+				stack[sp] = vm_call(e, &stack[sp], arg);
+				sp++;
+				break;
+
+			case OP_JUMP:
+				pc = arg - 2;
+				break;
+
+			case OP_BIND:
+				if (stack[sp-1].v && stack[sp-1].v->type == LVAL_ERR) { break; }
+				sp--;
+				e->frame[arg] = vslot_box(stack[sp]);
+				pc += 2;
+				break;
+
+			case OP_UNBIND:
+				if (e->frame[arg]) { lval_del(e->frame[arg]); }
+				e->frame[arg] = NULL;
+				break;
+
+			case OP_STORE:
+				temps[arg] = stack[sp-1];
+				if (temps[arg].v) { temps[arg].v = lval_copy(temps[arg].v); }
+				break;
+
+			case OP_LOAD:
+				stack[sp] = temps[arg];
+				if (stack[sp].v) { stack[sp].v = lval_copy(stack[sp].v); }
+				sp++;
+				break;
+
+			case OP_TAKE:
+				stack[sp] = temps[arg];
+				temps[arg].v = NULL;
+				sp++;
+				break;
+
+			case OP_DEF: {
+				lval* syms = c->consts[arg];
+				sp -= syms->count;
+				stack[sp] = vm_def(e, syms, &stack[sp]);
+				sp++;
+				break;
+			}
+
+			case OP_WHILE:
+			case OP_DOTIMES:
+			case OP_FOREACH: {
+				lloop* l = &c->loops[arg];
+				lval* x;
+				if (c->code[pc] == OP_WHILE) {
+					x = lval_while(e, l->cond, l->body);
+				} else {
+					sp--;
+					lval* n = vslot_box(stack[sp]);
+					x = c->code[pc] == OP_DOTIMES
+						? lval_dotimes(e, l->sym, n, l->body)
+						: lval_foreach(e, l->sym, n, l->body);
+				}
+				stack[sp].v = x;
+				sp++;
+				break;
+			}
+
+			case OP_EVAL: {
+				//eval of code bound to a global, which is read in place
+				lval* x = lenv_lookup(e, c->consts[arg]);
+				if (x && x->type == LVAL_QEXPR) {
+					x = lval_eval_code(e, x, 1);
+				} else {
+					x = x ? lval_err("Function 'eval' passed incorrect type!")
+						: lval_err("Unbound symbol!");
+				}
+				if (x->type == LVAL_NUM) {
+					stack[sp].v = NULL;
+					stack[sp].num = x->num;
+					lval_del(x);
+				} else {
+					stack[sp].v = x;
+				}
+				sp++;
+				break;
+			}
+
+			case OP_TREE: {
+				lval* x = lval_eval(e, lval_copy(c->consts[arg]));
+				if (x->type == LVAL_NUM) {
+					stack[sp].v = NULL;
+					stack[sp].num = x->num;
+					lval_del(x);
+				} else {
+					stack[sp].v = x;
+				}
+				sp++;
+				break;
+			}
+
+			case OP_IF: {
+				//a false condition jumps to the else branch. Anything but
+				//a number ends the if with an error, the jump before the
+				//else branch says where it ends
+				vslot* x = &stack[sp-1];
+				if (x->v == NULL) {
+					sp--;
+					if (x->num == 0) { pc = arg - 2; }
+					break;
+				}
+				if (x->v->type != LVAL_ERR) {
+					lval_del(x->v);
+					x->v = lval_err("Function 'if' passed incorrect type!");
+				}
+				pc = c->code[arg-1] - 2;
+				break;
+			}
+
+			case OP_AND:
+			case OP_OR: {
+				//and stops at the first false number and or at the first
+				//true one, leaving 0 or 1 as the result
+				vslot* x = &stack[sp-1];
+				int and = c->code[pc] == OP_AND;
+				if (x->v == NULL) {
+					if ((x->num != 0) == and) {
+						sp--;
+					} else {
+						x->num = !and;
+						pc = arg - 2;
+					}
+					break;
+				}
+				if (x->v->type != LVAL_ERR) {
+					lval_del(x->v);
+					x->v = lval_err(and ? "Function 'and' passed incorrect type!"
+						: "Function 'or' passed incorrect type!");
+				}
+				pc = arg - 2;
+				break;
+			}
+
+			case OP_JIT: {
+				//run native code once the region is hot, and its integer
+				//code until then. The bytecode that follows only runs
+				//when that can't be done on longs
+				ljit* j = &c->jits[arg];
+				if (use_jit && j->fn == NULL && j->runs <= JIT_HOT
+					&& ++j->runs == JIT_HOT) {
+					ljit_compile(j);
+				}
+				if (use_jit && j->fn) {
+					stack[sp] = ljit_run(e, j);
+				} else {
+					stack[sp].v = NULL;
+					if (!lint_run(e, j, &stack[sp].num)) { break; }
+				}
+				sp++;
+				pc = j->end - 2;
+				break;
+			}
+		}
+	}
+
+	vslot x = stack[0];
+	for (int i = 0; i < c->temps; i++) {
+		if (temps[i].v) { lval_del(temps[i].v); }
+	}
+	if (stack != local) { free(stack); }
+	return x;
+}
+
+//compile, run and delete v
+lval* lval_exec(lenv* e, lval* v) {
+	lchunk* c = lval_compile(e, v);
+	lval_del(v);
+	lval* x = lchunk_run(e, c);
+	lchunk_del(c);
+	return x;
+}
+
+//the builtin a region expression applies, NULL if the jit can't
+//compile it. comparisons only take exactly two arguments
+lbuiltin jit_op(lval* v) {
+	if (v->type != LVAL_SEXPR || v->count < 2) { return NULL; }
+	if (v->cell[0]->type != LVAL_SYM) { return NULL; }
 
-	 if (a->cell[0]->type != LVAL_QEXPR) {
-		 return lval_err("Function 'eval' passed incorrect type!");
-	 }
+	char* op = v->cell[0]->sym;
+	if (strcmp(op, "+") == 0) { return builtin_add; }
+	if (strcmp(op, "-") == 0) { return builtin_sub; }
+	if (strcmp(op, "*") == 0) { return builtin_mul; }
+	if (strcmp(op, "/") == 0) { return builtin_div; }
 
-	 lval* x = lval_take(a, 0);
-	 x->type = LVAL_SEXPR;
-	 return lval_eval(x);
+	if (v->count != 3) { return NULL; }
+	if (strcmp(op, ">") == 0)  { return builtin_gt; }
+	if (strcmp(op, "<") == 0)  { return builtin_lt; }
+	if (strcmp(op, ">=") == 0) { return builtin_ge; }
+	if (strcmp(op, "<=") == 0) { return builtin_le; }
+	if (strcmp(op, "==") == 0) { return builtin_eq; }
+	if (strcmp(op, "!=") == 0) { return builtin_ne; }
+	return NULL;
 }
 
-lval* builtin_join(lval* a) {
-	for (int i = 0; i < a->count; i++) {
-		if(a->cell[i]->type != LVAL_QEXPR) {
-			return lval_err("Function 'join' passed incorrect type.");
+//an arithmetic region is an operator applied to numbers, symbols
+//and other regions
+int jit_region(lval* v) {
+	if (jit_op(v) == NULL) { return 0; }
+	for (int i = 1; i < v->count; i++) {
+		lval* x = v->cell[i];
+		if (x->type == LVAL_NUM || x->type == LVAL_SYM) { continue; }
+		if (!jit_region(x)) { return 0; }
+	}
+	return 1;
+}
+
+int ljit_add(lchunk* c, lval* v) {
+	c->jits_count++;
+	c->jits = realloc(c->jits, sizeof(ljit) * c->jits_count);
+
+	ljit* j = &c->jits[c->jits_count-1];
+	j->src = lval_copy(v);
+	j->end = 0;
+	j->runs = 0;
+	j->syms_count = 0;
+	j->syms = NULL;
+	j->heads_count = 0;
+	j->heads = NULL;
+	j->funs = NULL;
+	j->ints_count = 0;
+	j->ints = NULL;
+	j->ints_depth = 0;
+	j->fn = NULL;
+	j->size = 0;
+	ljit_inputs(j, j->src);
+	lint_expr(j, j->src, 0);
+	return c->jits_count-1;
+}
+
+//collect the distinct leaf symbols and every head of a region
+void ljit_inputs(ljit* j, lval* v) {
+	j->heads_count++;
+	j->heads = realloc(j->heads, sizeof(lval*) * j->heads_count);
+	j->funs = realloc(j->funs, sizeof(lbuiltin) * j->heads_count);
+	j->heads[j->heads_count-1] = v->cell[0];
+	j->funs[j->heads_count-1] = jit_op(v);
+
+	for (int i = 1; i < v->count; i++) {
+		lval* x = v->cell[i];
+		if (x->type == LVAL_SEXPR) { ljit_inputs(j, x); continue; }
+		if (x->type != LVAL_SYM) { continue; }
+
+		int seen = 0;
+		for (int k = 0; k < j->syms_count; k++) {
+			if (strcmp(j->syms[k]->sym, x->sym) == 0) { seen = 1; break; }
 		}
+		if (seen) { continue; }
+		j->syms_count++;
+		j->syms = realloc(j->syms, sizeof(lval*) * j->syms_count);
+		j->syms[j->syms_count-1] = x;
 	}
+}
 
-	lval* x = lval_pop(a, 0);
+void ljit_del(ljit* j) {
+	if (j->fn) { munmap((void*)j->fn, j->size); }
+	free(j->syms);
+	free(j->heads);
+	free(j->funs);
+	free(j->ints);
+	lval_del(j->src);
+}
 
-	while (a->count) {
-		x = lval_join(x, lval_pop(a, 0));
+void lint_emit(ljit* j, long op, long arg) {
+	j->ints_count += 2;
+	j->ints = realloc(j->ints, sizeof(long) * j->ints_count);
+	j->ints[j->ints_count-2] = op;
+	j->ints[j->ints_count-1] = arg;
+}
+
+//generate integer code leaving the value of v on top of the stack, sp
+//is the depth before it runs. Operators fold their arguments left to
+//right like builtin_op
+void lint_expr(ljit* j, lval* v, int sp) {
+	if (sp + 1 > j->ints_depth) { j->ints_depth = sp + 1; }
+
+	if (v->type == LVAL_NUM) {
+		lint_emit(j, INT_NUM, v->num);
+		return;
+	}
+	if (v->type == LVAL_SYM) {
+		int i = 0;
+		while (strcmp(j->syms[i]->sym, v->sym) != 0) { i++; }
+		lint_emit(j, INT_SYM, i);
+		return;
 	}
 
-	lval_del(a);
-	return x;
+	lbuiltin f = jit_op(v);
+	int op = f == builtin_add ? INT_ADD : f == builtin_sub ? INT_SUB
+		: f == builtin_mul ? INT_MUL : f == builtin_div ? INT_DIV
+		: f == builtin_gt ? INT_GT : f == builtin_lt ? INT_LT
+		: f == builtin_ge ? INT_GE : f == builtin_le ? INT_LE
+		: f == builtin_eq ? INT_EQ : INT_NE;
+
+	lint_expr(j, v->cell[1], sp);
+	if (op == INT_SUB && v->count == 2) { lint_emit(j, INT_NEG, 0); }
+	for (int i = 2; i < v->count; i++) {
+		lint_expr(j, v->cell[i], sp + 1);
+		lint_emit(j, op, 0);
+	}
 }
 
-lval* lval_join(lval* x, lval* y) {
-	//for each cell in 'y' join it with 'x'
-	while (y->count) {
-		x = lval_add(x, lval_pop(y, 0));
+//read the inputs of a region into in, 0 if one isn't a number or an
+//operator has been redefined since the region was compiled
+int ljit_load(lenv* e, ljit* j, long* in) {
+	for (int i = 0; i < j->heads_count; i++) {
+		lval* f = lenv_lookup(e, j->heads[i]);
+		if (!f || f->type != LVAL_FUN || f->fun != j->funs[i]) { return 0; }
+	}
+	for (int i = 0; i < j->syms_count; i++) {
+		lval* x = lenv_lookup(e, j->syms[i]);
+		if (!x || x->type != LVAL_NUM) { return 0; }
+		in[i] = x->num;
 	}
+	return 1;
+}
 
-	//delete the empty list 'y' and return 'x'
-	lval_del(y);
-	return x;
+//run a region's integer code without making any lvals. 0 is returned
+//when it can't be done on longs: an input isn't a number, or the
+//result would overflow or be a division error, all of which the
+//bytecode that follows the region handles
+int lint_run(lenv* e, ljit* j, long* out) {
+	long in[j->syms_count + 1];
+	long s[j->ints_depth];
+	if (!ljit_load(e, j, in)) { return 0; }
+
+	int sp = 0;
+	for (int pc = 0; pc < j->ints_count; pc += 2) {
+		long op = j->ints[pc];
+		if (op == INT_NUM) { s[sp++] = j->ints[pc+1]; continue; }
+		if (op == INT_SYM) { s[sp++] = in[j->ints[pc+1]]; continue; }
+
+		long b = s[sp-1];
+		if (op == INT_NEG) {
+			if (b == LONG_MIN) { return 0; }
+			s[sp-1] = -b;
+			continue;
+		}
+
+		long* a = &s[sp-2];
+		switch (op) {
+
+			case INT_ADD: if (__builtin_add_overflow(*a, b, a)) { return 0; } break;
+			case INT_SUB: if (__builtin_sub_overflow(*a, b, a)) { return 0; } break;
+			case INT_MUL: if (__builtin_mul_overflow(*a, b, a)) { return 0; } break;
+			case INT_DIV:
+				if (b == 0 || (b == -1 && *a == LONG_MIN)) { return 0; }
+				*a /= b;
+				break;
+
+			case INT_GT: *a = *a >  b; break;
+			case INT_LT: *a = *a <  b; break;
+			case INT_GE: *a = *a >= b; break;
+			case INT_LE: *a = *a <= b; break;
+			case INT_EQ: *a = *a == b; break;
+			case INT_NE: *a = *a != b; break;
+		}
+		sp--;
+	}
+	*out = s[0];
+	return 1;
 }
 
-void lval_print(lval* v) {
-	 switch (v->type) {
-		 case LVAL_NUM: 
-			 printf("%li", v->num);
-			 break;
-		 case LVAL_ERR:
-			 printf("Error: %s", v->err);
-			 break;
-		 case LVAL_SYM:
-			 printf("%s", v->sym);
-			 break;
-		 case LVAL_FUN: 
-			 printf("<function>");
-			 break;
-		 case LVAL_SEXPR:
-			 lval_expr_print(v, '(', ')');
-			 break;
-		 case LVAL_QEXPR:
-			 lval_expr_print(v, '{', '}');
-			 break;
-	 }
+void lasm_bytes(lasm* a, const char* bytes, int n) {
+	a->code = realloc(a->code, a->count + n);
+	memcpy(a->code + a->count, bytes, n);
+	a->count += n;
 }
 
-void lval_println(lval* v) {
-	 lval_print(v);
-	 putchar('\n');
+void lasm_imm(lasm* a, long x, int n) {
+	char bytes[8];
+	for (int i = 0; i < n; i++) { bytes[i] = (x >> (8 * i)) & 0xff; }
+	lasm_bytes(a, bytes, n);
+}
+
+//emit a conditional jump (0f opcode) to the bail out
+void lasm_bail(lasm* a, char cond) {
+	char jcc[2] = { 0x0f, cond };
+	lasm_bytes(a, jcc, 2);
+	a->bails_count++;
+	a->bails = realloc(a->bails, sizeof(int) * a->bails_count);
+	a->bails[a->bails_count-1] = a->count;
+	lasm_imm(a, 0, 4);
+}
+
+//generate code leaving the value of v in rax. rdi points at the
+//input values and rsi at the result, neither is touched
+void lasm_expr(lasm* a, ljit* j, lval* v) {
+	if (v->type == LVAL_NUM) {
+		lasm_bytes(a, "\x48\xb8", 2);                   //mov rax, imm64
+		lasm_imm(a, v->num, 8);
+		return;
+	}
+
+	if (v->type == LVAL_SYM) {
+		int i = 0;
+		while (strcmp(j->syms[i]->sym, v->sym) != 0) { i++; }
+		lasm_bytes(a, "\x48\x8b\x87", 3);               //mov rax, [rdi+8i]
+		lasm_imm(a, 8 * i, 4);
+		return;
+	}
+
+	lbuiltin f = jit_op(v);
+	lasm_expr(a, j, v->cell[1]);
+
+	//if no arguments and sub, then perform unary negation
+	if (f == builtin_sub && v->count == 2) {
+		lasm_bytes(a, "\x48\xf7\xd8", 3);               //neg rax
+		lasm_bail(a, JO);
+	}
+
+	for (int i = 2; i < v->count; i++) {
+		lasm_bytes(a, "\x50", 1);                       //push rax
+		lasm_expr(a, j, v->cell[i]);
+		lasm_bytes(a, "\x48\x89\xc1\x58", 4);           //mov rcx, rax; pop rax
+
+		if (f == builtin_add) {
+			lasm_bytes(a, "\x48\x01\xc8", 3);           //add rax, rcx
+			lasm_bail(a, JO);
+		}
+		if (f == builtin_sub) {
+			lasm_bytes(a, "\x48\x29\xc8", 3);           //sub rax, rcx
+			lasm_bail(a, JO);
+		}
+		if (f == builtin_mul) {
+			lasm_bytes(a, "\x48\x0f\xaf\xc1", 4);       //imul rax, rcx
+			lasm_bail(a, JO);
+		}
+		if (f == builtin_div) {
+			//division by zero is left to the interpreter's error and
+			//dividing by -1 is a negation, so idiv never traps
+			lasm_bytes(a, "\x48\x85\xc9", 3);           //test rcx, rcx
+			lasm_bail(a, JE);
+			lasm_bytes(a, "\x48\x83\xf9\xff\x75\x0b", 6); //cmp rcx, -1; jne idiv
+			lasm_bytes(a, "\x48\xf7\xd8", 3);           //neg rax
+			lasm_bail(a, JO);
+			lasm_bytes(a, "\xeb\x05", 2);               //jmp past idiv
+			lasm_bytes(a, "\x48\x99\x48\xf7\xf9", 5);   //cqo; idiv rcx
+		}
+
+		//comparisons set rax to 0 or 1
+		char set = 0;
+		if (f == builtin_gt) { set = 0x9f; }
+		if (f == builtin_lt) { set = 0x9c; }
+		if (f == builtin_ge) { set = 0x9d; }
+		if (f == builtin_le) { set = 0x9e; }
+		if (f == builtin_eq) { set = 0x94; }
+		if (f == builtin_ne) { set = 0x95; }
+		if (set) {
+			char cmp[9] = { 0x48, 0x39, 0xc8, 0x0f, set, 0xc0, 0x0f, 0xb6, 0xc0 };
+			lasm_bytes(a, cmp, 9);                      //cmp; setcc al; movzx
+		}
+	}
+}
+
+//generate and map the native code for a region, 0 on failure
+int ljit_compile(ljit* j) {
+#if defined(__x86_64__)
+	lasm a = { 0, NULL, 0, NULL };
+	lasm_bytes(&a, "\x55\x48\x89\xe5", 4);              //push rbp; mov rbp, rsp
+	lasm_expr(&a, j, j->src);
+
+	//success stores the result and returns 1, bail outs return 0
+	lasm_bytes(&a, "\x48\x89\x06", 3);                  //mov [rsi], rax
+	lasm_bytes(&a, "\xb8\x01\x00\x00\x00", 5);          //mov eax, 1
+	lasm_bytes(&a, "\x48\x89\xec\x5d\xc3", 5);          //mov rsp, rbp; pop rbp; ret
+	int bail = a.count;
+	lasm_bytes(&a, "\x31\xc0", 2);                      //xor eax, eax
+	lasm_bytes(&a, "\x48\x89\xec\x5d\xc3", 5);          //mov rsp, rbp; pop rbp; ret
+
+	for (int i = 0; i < a.bails_count; i++) {
+		int rel = bail - (a.bails[i] + 4);
+		memcpy(a.code + a.bails[i], &rel, 4);
+	}
+
+	void* mem = mmap(NULL, a.count, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem != MAP_FAILED) {
+		memcpy(mem, a.code, a.count);
+		if (mprotect(mem, a.count, PROT_READ | PROT_EXEC) == 0) {
+			j->fn = (ljitfn)mem;
+			j->size = a.count;
+		} else {
+			munmap(mem, a.count);
+		}
+	}
+
+	free(a.code);
+	free(a.bails);
+	return j->fn != NULL;
+#else
+	return 0;
+#endif
+}
+
+//run a compiled region, falling back to lval_eval when an input
+//isn't a number, an operator was redefined or the code bails out
+vslot ljit_run(lenv* e, ljit* j) {
+	vslot r = { NULL, 0 };
+	long in[j->syms_count + 1];
+	int ok = ljit_load(e, j, in);
+	if (ok) { ok = j->fn(in, &r.num); }
+
+	//in checking mode every native result is compared as well
+	if (ok && use_jit != 2) { return r; }
+
+	lval* x = lval_eval(e, lval_copy(j->src));
+	if (ok && (x->type != LVAL_NUM || x->num != r.num)) {
+		printf("jit: mismatch on ");
+		lval_print(j->src);
+		printf(", native %li, interpreter ", r.num);
+		lval_println(x);
+	}
+
+	if (x->type == LVAL_NUM) {
+		r.num = x->num;
+		lval_del(x);
+	} else {
+		r.v = x;
+	}
+	return r;
+}
+
+//translate every top level expression of a file to a C function that
+//calls the builtins directly, the result is built against this file
+void lval_emit_c(mpc_parser_t* p, char* filename, FILE* out) {
+	mpc_result_t r;
+	if (!mpc_parse_contents(filename, p, &r)) {
+		mpc_err_print(r.error);
+		mpc_err_delete(r.error);
+		return;
+	}
+	lval* prog = lval_read(r.output);
+	mpc_ast_delete(r.output);
+
+	//a fresh environment tells builtins apart from anything loaded
+	lemit m = { tmpfile(), lenv_new(), 0, 0, 0, 0, NULL, 0, 0, 0, NULL, 0, NULL, 0, NULL };
+	lenv_add_builtins(m.e);
+	lemit_scan(&m, prog);
+
+	for (int i = 0; i < prog->count; i++) {
+		lemit_top(&m, prog->cell[i], i);
+	}
+
+	fprintf(out, "//generated by lispy --emit-c from %s, build it with\n", filename);
+	fprintf(out, "//gcc -std=c99 -Wall -I<lispy> out.c <lispy>/mpc.c -ledit -lm\n");
+	fprintf(out, "#define LISPY_EMBED\n#include \"parsing.c\"\n\n");
+	fprintf(out, "static lval* S[%i];\n", m.syms_count + 1);
+	fprintf(out, "static lbuiltin F[%i];\n", m.funs_count + 1);
+	fprintf(out, "static long N[%i];\n\n", m.nums_count + 1);
+
+	rewind(m.out);
+	int ch;
+	while ((ch = fgetc(m.out)) != EOF) { fputc(ch, out); }
+	fclose(m.out);
+
+	fprintf(out, "static lval* (*top[%i])(lenv*) = {", prog->count + 1);
+	for (int i = 0; i < prog->count; i++) { fprintf(out, " top_%i,", i); }
+	fprintf(out, " NULL };\n\n");
+
+	fprintf(out, "int main(int argc, char** argv) {\n");
+	fprintf(out, "\tlenv* e = lenv_new();\n\tlenv_add_builtins(e);\n");
+	for (int i = 0; i < m.syms_count; i++) {
+		fprintf(out, "\tS[%i] = lval_sym(\"", i);
+		for (char* c = m.syms[i]; *c; c++) {
+			if (*c == '\\' || *c == '"') { fputc('\\', out); }
+			fputc(*c, out);
+		}
+		fprintf(out, "\");\n");
+	}
+	for (int i = 0; i < m.funs_count; i++) {
+		fprintf(out, "\tF[%i] = lenv_lookup(e, S[%i])->fun;\n", i,
+			lemit_find(m.syms, m.syms_count, m.funs[i]));
+	}
+	fprintf(out, "\n\tfor (int i = 0; top[i]; i++) {\n");
+	fprintf(out, "\t\tlval* x = top[i](e);\n");
+	fprintf(out, "\t\tif (x->type == LVAL_ERR) { lval_println(x); }\n");
+	fprintf(out, "\t\tlval_del(x);\n\t}\n\n");
+	fprintf(out, "\tfor (int i = 0; i < %i; i++) { lval_del(S[i]); }\n", m.syms_count);
+	fprintf(out, "\tlenv_del(e);\n\treturn 0;\n}\n");
+
+	for (int i = 0; i < m.defs_count; i++) { free(m.defs[i]); }
+	for (int i = 0; i < m.syms_count; i++) { free(m.syms[i]); }
+	for (int i = 0; i < m.funs_count; i++) { free(m.funs[i]); }
+	for (int i = 0; i < m.nums_count; i++) { free(m.nums[i]); }
+	free(m.defs);
+	free(m.syms);
+	free(m.funs);
+	free(m.nums);
+	lenv_del(m.e);
+	lval_del(prog);
+}
+
+//index of s in names, adding a copy if it isn't there yet
+int lemit_intern(char*** names, int* count, char* s) {
+	int i = lemit_find(*names, *count, s);
+	if (i != -1) { return i; }
+
+	(*count)++;
+	*names = realloc(*names, sizeof(char*) * *count);
+	(*names)[*count-1] = malloc(strlen(s) + 1);
+	strcpy((*names)[*count-1], s);
+	return *count-1;
+}
+
+int lemit_find(char** names, int count, char* s) {
+	for (int i = 0; i < count; i++) {
+		if (strcmp(names[i], s) == 0) { return i; }
+	}
+	return -1;
 }
 
-void lval_expr_print(lval* v, char open, char close) {
-	putchar(open);
+//record every name def can bind. Q-expressions may be evaluated
+//later so they are scanned as code too, and def used anywhere but
+//at the head of a literal symbol list means any name can change, as
+//does a macro, whose expansions can hold any def
+void lemit_scan(lemit* m, lval* v) {
+	if (v->type != LVAL_SEXPR && v->type != LVAL_QEXPR) { return; }
+
 	for (int i = 0; i < v->count; i++) {
-		//print value containined in this cell
-		lval_print(v->cell[i]);
+		lval* x = v->cell[i];
+		if (x->type == LVAL_SYM && strcmp(x->sym, "defmacro") == 0) {
+			m->macros = 1;
+			m->dynamic = 1;
+		}
+		if (x->type == LVAL_SYM && x->sym[0] == '~') { m->lazy = 1; }
+		if (x->type == LVAL_SYM && (strcmp(x->sym, "def") == 0
+			|| strcmp(x->sym, "dotimes") == 0 || strcmp(x->sym, "foreach") == 0)) {
+			if (i != 0 || v->count < 2 || v->cell[1]->type != LVAL_QEXPR) {
+				m->dynamic = 1;
+				continue;
+			}
+			for (int j = 0; j < v->cell[1]->count; j++) {
+				lval* k = v->cell[1]->cell[j];
+				if (k->type != LVAL_SYM) { continue; }
+				m->defs_count++;
+				m->defs = realloc(m->defs, sizeof(char*) * m->defs_count);
+				m->defs[m->defs_count-1] = malloc(strlen(k->sym) + 1);
+				strcpy(m->defs[m->defs_count-1], k->sym);
+			}
+		}
+		lemit_scan(m, x);
+	}
+}
 
-		//don't print trailing spaces
-		if (i != (v->count-1)) {
-			putchar(' ');
+//is v a symbol that always names the same builtin
+int lemit_fun(lemit* m, lval* v) {
+	if (v->type != LVAL_SYM || m->dynamic) { return 0; }
+	if (lemit_find(m->defs, m->defs_count, v->sym) != -1) { return 0; }
+	lval* f = lenv_lookup(m->e, v);
+	return f && f->type == LVAL_FUN;
+}
+
+//can v be computed on unboxed longs, fails is set if it might divide
+//by zero or overflow and need the slow path for the error or the big
+//integer result
+int lemit_numeric(lemit* m, lval* v, int* fails) {
+	if (v->type == LVAL_NUM) { return 1; }
+	if (v->type == LVAL_SYM) {
+		return lemit_find(m->nums, m->nums_count, v->sym) != -1;
+	}
+
+	lbuiltin f = jit_op(v);
+	if (f == NULL || !lemit_fun(m, v->cell[0])) { return 0; }
+	if (f == builtin_add || f == builtin_sub || f == builtin_mul) { *fails = 1; }
+	for (int i = 1; i < v->count; i++) {
+		if (!lemit_numeric(m, v->cell[i], fails)) { return 0; }
+		if (f == builtin_div && i > 1 && !lemit_divisor(v->cell[i])) {
+			*fails = 1;
 		}
 	}
-	putchar(close);
+	return 1;
 }
 
-lval* lval_copy(lval* v) {
-	lval* x = malloc(sizeof(lval));
-	x->type = v->type;
+//a literal divisor that can neither be zero nor overflow
+int lemit_divisor(lval* v) {
+	return v->type == LVAL_NUM && v->num != 0 && v->num != -1;
+}
+
+//can evaluating v never produce an error
+int lemit_infallible(lemit* m, lval* v) {
+	int fails = 0;
+	if (v->type == LVAL_QEXPR) { return 1; }
+	return lemit_numeric(m, v, &fails) && !fails;
+}
 
+void lemit_sym(lemit* m, char* s) {
+	fprintf(m->out, "S[%i]", lemit_intern(&m->syms, &m->syms_count, s));
+}
+
+//build a literal value, returning the temporary holding it
+int lemit_const(lemit* m, lval* v) {
+	int t = m->temps++;
 	switch (v->type) {
-		//copy functions and numbers directly
-		case LVAL_FUN:
-			x->fun = v->fun;
-			break;
 		case LVAL_NUM:
-			x->num = v->num;
+			fprintf(m->out, "\tlval* t%i = lval_num(%liL);\n", t, v->num);
 			break;
-
-		//copy strings using malloc and strcpy
-		case LVAL_ERR:
-			x->err = malloc(strlen(v->err) + 1);
-			strcpy(x->err, v->err);
+		case LVAL_BIG: {
+			char* d = lbig_str(v);
+			fprintf(m->out, "\tlval* t%i = lval_big_str(\"%s\");\n", t, d);
+			free(d);
+			break;
+		}
+		//in hex so the value is exact
+		case LVAL_DBL:
+			fprintf(m->out, "\tlval* t%i = lval_dbl(%a);\n", t, v->dbl);
 			break;
 		case LVAL_SYM:
-			x->sym = malloc(strlen(v->sym) + 1);
-			strcpy(x->sym, v->sym);
+			fprintf(m->out, "\tlval* t%i = lval_copy(", t);
+			lemit_sym(m, v->sym);
+			fprintf(m->out, ");\n");
 			break;
-
-		//copy lists by copying each sub-expression
 		case LVAL_SEXPR:
 		case LVAL_QEXPR:
-			x->count = v->count;
-			x->cell = malloc(sizeof(lval*) * x->count);
-			for (int i = 0; i < x->count; i++) {
-				x->cell[i] = lval_copy(v->cell[i]);
+			fprintf(m->out, "\tlval* t%i = %s;\n", t,
+				v->type == LVAL_SEXPR ? "lval_sexpr()" : "lval_qexpr()");
+			for (int i = 0; i < v->count; i++) {
+				int x = lemit_const(m, v->cell[i]);
+				fprintf(m->out, "\tlval_add(t%i, t%i);\n", t, x);
 			}
 			break;
 	}
-	return x;
+	return t;
 }
 
-//cleanup
-void lval_del(lval* v) {
-	switch (v->type) {
-		case LVAL_NUM: break;
+//compute numeric v into a long, division by zero jumps to slow
+int lemit_num(lemit* m, lval* v, int slow) {
+	int n = m->temps++;
+	if (v->type == LVAL_NUM) {
+		if (v->num == LONG_MIN) {
+			fprintf(m->out, "\tlong n%i = LONG_MIN;\n", n);
+		} else {
+			fprintf(m->out, "\tlong n%i = %liL;\n", n, v->num);
+		}
+		return n;
+	}
+	if (v->type == LVAL_SYM) {
+		fprintf(m->out, "\tlong n%i = N[%i];\n", n,
+			lemit_find(m->nums, m->nums_count, v->sym));
+		return n;
+	}
 
-		case LVAL_ERR: free(v->err); break;
-		case LVAL_SYM: free(v->sym); break;
-		case LVAL_FUN: break;
+	lbuiltin f = jit_op(v);
+	int x = lemit_num(m, v->cell[1], slow);
+	fprintf(m->out, "\tlong n%i = n%i;\n", n, x);
 
-		//if qexpr or sexpr then delete all elements in the expression
-		case LVAL_QEXPR:
-		case LVAL_SEXPR:
-		   for (int i = 0; i < v->count; i++) {
-			   lval_del(v->cell[i]);
-		   }
-		   free(v->cell);
-		   break;
+	//if no arguments and sub, then perform unary negation
+	if (f == builtin_sub && v->count == 2) {
+		fprintf(m->out, "\tif (n%i == LONG_MIN) { goto slow%i; }\n", n, slow);
+		fprintf(m->out, "\tn%i = -n%i;\n", n, n);
 	}
 
-	free(v);
-}
-
-lenv* lenv_new(void) {
-	lenv* e = malloc(sizeof(lenv));
-	e->count = 0;
-	e->syms = NULL;
-	e->vals = NULL;
-	return e;
+	//overflow goes to the slow path, which makes a big integer
+	for (int i = 2; i < v->count; i++) {
+		int y = lemit_num(m, v->cell[i], slow);
+		char* checked = f == builtin_add ? "add" : f == builtin_sub ? "sub"
+			: f == builtin_mul ? "mul" : NULL;
+		if (checked) {
+			fprintf(m->out, "\tif (__builtin_%s_overflow(n%i, n%i, &n%i)) { goto slow%i; }\n",
+				checked, n, y, n, slow);
+		}
+		if (f == builtin_div) {
+			if (!lemit_divisor(v->cell[i])) {
+				fprintf(m->out, "\tif (n%i == 0 || (n%i == -1 && n%i == LONG_MIN)) { goto slow%i; }\n",
+					y, y, n, slow);
+			}
+			fprintf(m->out, "\tn%i /= n%i;\n", n, y);
+		}
+		if (f == builtin_gt) { fprintf(m->out, "\tn%i = n%i > n%i;\n", n, n, y); }
+		if (f == builtin_lt) { fprintf(m->out, "\tn%i = n%i < n%i;\n", n, n, y); }
+		if (f == builtin_ge) { fprintf(m->out, "\tn%i = n%i >= n%i;\n", n, n, y); }
+		if (f == builtin_le) { fprintf(m->out, "\tn%i = n%i <= n%i;\n", n, n, y); }
+		if (f == builtin_eq) { fprintf(m->out, "\tn%i = n%i == n%i;\n", n, n, y); }
+		if (f == builtin_ne) { fprintf(m->out, "\tn%i = n%i != n%i;\n", n, n, y); }
+	}
+	return n;
 }
 
-lval* lenv_get(lenv* e, lval* k) {
-	//iterate over all items in environment
-	for (int i = 0; i < e->count; i++) {
-		//return a copy of value, if the symbol matches a stored string
-		if(strcmp(e->syms[i], k->sym) == 0) {
-			return lval_copy(e->vals[i]);
+//emit code evaluating v, returning the temporary holding its value
+int lemit_expr(lemit* m, lval* v) {
+	if (v->type == LVAL_SYM) {
+		int t = m->temps++;
+		int n = lemit_find(m->nums, m->nums_count, v->sym);
+		if (n != -1) {
+			fprintf(m->out, "\tlval* t%i = lval_num(N[%i]);\n", t, n);
+		} else {
+			fprintf(m->out, "\tlval* t%i = lenv_get(e, ", t);
+			lemit_sym(m, v->sym);
+			fprintf(m->out, ");\n");
 		}
+		return t;
 	}
-	//if no symbol is found, return error
-	return lval_err("Unbound symbol!");
+
+	if (v->type != LVAL_SEXPR || v->count == 0) { return lemit_const(m, v); }
+	if (v->count == 1) { return lemit_expr(m, v->cell[0]); }
+
+	//provably numeric expressions run on longs and are boxed once,
+	//falling back to the builtins if they could hit division by zero
+	int fails = 0;
+	if (!lemit_numeric(m, v, &fails)) { return lemit_apply(m, v); }
+
+	int t = m->temps++;
+	int slow = m->labels++;
+	fprintf(m->out, "\tlval* t%i;\n", t);
+	int n = lemit_num(m, v, slow);
+	fprintf(m->out, "\tt%i = lval_num(n%i);\n", t, n);
+	if (fails) {
+		fprintf(m->out, "\tgoto done%i;\nslow%i: ;\n", slow, slow);
+		int x = lemit_apply(m, v);
+		fprintf(m->out, "\tt%i = t%i;\ndone%i: ;\n", t, x, slow);
+	}
+	return t;
 }
 
-void lenv_put(lenv* e, lval* k, lval* v) {
-	//iterate over all items in environment
-	for (int i = 0; i< e->count; i++) {
-		//if variable is found delete item at position
-		//and replace with new variable
-		if (strcmp(e->syms[i], k->sym) == 0) {
-			lval_del(e->vals[i]);
-			e->vals[i] = lval_copy(v);
-			return;
-		}
+//emit a function application, calling the builtin directly when the
+//head can only ever name that builtin
+int lemit_apply(lemit* m, lval* v) {
+	//special forms are left to the evaluator with their arguments as
+	//they were written
+	if (lemit_fun(m, v->cell[0])
+		&& lval_special(lenv_lookup(m->e, v->cell[0])->fun)) {
+		int x = lemit_const(m, v);
+		int t = m->temps++;
+		fprintf(m->out, "\tlval* t%i = lval_eval(e, t%i);\n", t, x);
+		return t;
 	}
 
-	//if variable does not already exist, make space for a new variable
-	e->count++;
-	e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-	e->syms = realloc(e->syms, sizeof(char*) * e->count);
+	int direct = lemit_fun(m, v->cell[0]);
+	int t = m->temps++;
+	int a = m->temps++;
+	int done = m->labels++;
+	fprintf(m->out, "\tlval* t%i;\n", t);
+	fprintf(m->out, "\tlval* t%i = lval_sexpr();\n", a);
+	for (int i = direct; i < v->count; i++) {
+		int x = lemit_expr(m, v->cell[i]);
+		fprintf(m->out, "\tlval_add(t%i, t%i);\n", a, x);
 
-	//copy contents of lval and symbol string into new location
-	e->vals[e->count-1] = lval_copy(v);
-	e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-	strcpy(e->syms[e->count-1], k->sym);
+		//a head that turns out to be a macro or lazy lambda gets the
+		//code as written
+		if (i == 0 && (m->macros || m->lazy)) {
+			fprintf(m->out, "\tif (lval_macro(t%i) || lval_lazy(t%i)) {\n\tlval_del(t%i);\n",
+				x, x, a);
+			int y = lemit_const(m, v);
+			fprintf(m->out, "\tt%i = lval_eval(e, t%i);\n\tgoto done%i;\n\t}\n", t, y, done);
+		}
+	}
+
+	if (direct) {
+		fprintf(m->out, "\tt%i = lval_call(e, F[%i], t%i);\n", t,
+			lemit_intern(&m->funs, &m->funs_count, v->cell[0]->sym), a);
+		lemit_intern(&m->syms, &m->syms_count, v->cell[0]->sym);
+	} else {
+		fprintf(m->out, "\tt%i = lval_eval(e, t%i);\n", t, a);
+	}
+	if (m->macros || m->lazy) { fprintf(m->out, "done%i: ;\n", done); }
+	return t;
 }
 
-void lenv_del(lenv* e) {
-	for (int i = 0; i< e->count; i++) {
-		free(e->syms[i]);
-		lval_del(e->vals[i]);
+//emit top level expression n. a def that binds numbers to names that
+//are never bound anywhere else, and that cannot fail, makes those
+//names unboxed for the rest of the file
+void lemit_top(lemit* m, lval* v, int n) {
+	fprintf(m->out, "static lval* top_%i(lenv* e) {\n", n);
+	int t = lemit_expr(m, v);
+	m->temps = 0;
+	m->labels = 0;
+
+	int mirror = v->type == LVAL_SEXPR && v->count >= 2
+		&& lemit_fun(m, v->cell[0]) && strcmp(v->cell[0]->sym, "def") == 0
+		&& v->cell[1]->type == LVAL_QEXPR && v->cell[1]->count == v->count-2;
+	for (int i = 2; i < v->count && mirror; i++) {
+		mirror = lemit_infallible(m, v->cell[i])
+			&& v->cell[1]->cell[i-2]->type == LVAL_SYM;
 	}
-	free(e->syms);
-	free(e->vals);
-	free(e);
+
+	for (int i = 2; i < v->count && mirror; i++) {
+		int fails = 0;
+		char* name = v->cell[1]->cell[i-2]->sym;
+		int once = 0;
+		for (int j = 0; j < m->defs_count; j++) {
+			once += strcmp(m->defs[j], name) == 0;
+		}
+		if (once != 1 || !lemit_numeric(m, v->cell[i], &fails)) { continue; }
+
+		fprintf(m->out, "\tN[%i] = lenv_lookup(e, ",
+			lemit_intern(&m->nums, &m->nums_count, name));
+		lemit_sym(m, name);
+		fprintf(m->out, ")->num;\n");
+	}
+
+	fprintf(m->out, "\treturn t%i;\n}\n\n", t);
 }